@@ -1,9 +1,15 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
+
+#include <zlib.h>
 
 typedef void (*sighandler_t)(int sig);
 
@@ -11,6 +17,45 @@ typedef void (*sighandler_t)(int sig);
 #include "cereal/messaging/impl_msgq.h"
 #include "cereal/messaging/impl_zmq.h"
 
+// Batched link: all services share one zmq socket on a port outside the range used by services.
+// A batch is a BatchHeader followed by entries of [uint8 name length][name][uint32 size][data],
+// deflated as a whole when compression is on and it makes the batch smaller.
+#define BATCH_PORT "8190"
+#define BATCH_MAGIC 0x48435442  // "BTCH"
+#define BATCH_COMPRESSED 1
+// A batch is sent early once it gets this big, this bounds latency and memory use
+#define MAX_BATCH_SIZE (2 * 1024 * 1024)
+#define REPORT_INTERVAL_NS 5000000000ULL
+// deflate can't shrink data more than this
+#define MAX_DEFLATE_RATIO 1032
+
+struct BatchHeader {
+  uint32_t magic;
+  uint16_t flags;
+  uint16_t count;
+  uint32_t size;  // size of the entries before compression
+};
+
+struct BridgeOptions {
+  bool batch = false;
+  bool compress = false;
+  std::map<std::string, double> rate;  // max frequency per service
+  std::vector<std::string> args;
+};
+
+struct BridgeStats {
+  uint64_t msgs_in = 0, msgs_out = 0, msgs_capped = 0, send_errors = 0;
+  uint64_t bytes_in = 0, bytes_out = 0, batches = 0, full_batches = 0;
+  uint64_t busy_ns = 0;
+};
+
+struct Forward {
+  PubSocket *pub = nullptr;  // NULL when batching
+  std::string name;
+  uint64_t min_interval = 0;  // rate cap, 0 means no cap
+  uint64_t last_forward = 0;
+};
+
 std::atomic<bool> do_exit = false;
 static void set_do_exit(int sig) {
   do_exit = true;
@@ -21,6 +66,10 @@ void sigpipe_handler(int sig) {
   std::cout << "SIGPIPE received" << std::endl;
 }
 
+static uint64_t nanos_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 static std::vector<std::string> get_services(std::string whitelist_str, bool zmq_to_msgq) {
   std::vector<std::string> service_list;
   for (const auto& it : services) {
@@ -34,14 +83,263 @@ static std::vector<std::string> get_services(std::string whitelist_str, bool zmq
   return service_list;
 }
 
+static int send_retry(PubSocket *pub, char *data, size_t size, BridgeStats &stats) {
+  int ret;
+  do {
+    ret = pub->send(data, size);
+  } while (ret == -1 && errno == EINTR && !do_exit);
+
+  if (ret < 0) {
+    stats.send_errors++;
+  } else {
+    stats.bytes_out += size;
+  }
+  return ret;
+}
+
+class BatchWriter {
+public:
+  BatchWriter(PubSocket *pub, bool compress) : pub_(pub), compress_(compress) {}
+
+  // Copies a message into the batch. Returns the offset to roll back to with discard().
+  size_t add(const std::string &name, const char *data, size_t size) {
+    size_t offset = entries_.size();
+    uint8_t name_len = name.size();
+    uint32_t data_size = size;
+    entries_.insert(entries_.end(), (char *)&name_len, (char *)&name_len + sizeof(name_len));
+    entries_.insert(entries_.end(), name.begin(), name.end());
+    entries_.insert(entries_.end(), (char *)&data_size, (char *)&data_size + sizeof(data_size));
+    entries_.insert(entries_.end(), data, data + size);
+    count_++;
+    return offset;
+  }
+
+  void discard(size_t offset) {
+    entries_.resize(offset);
+    count_--;
+  }
+
+  bool full() const {
+    return entries_.size() >= MAX_BATCH_SIZE || count_ == UINT16_MAX;
+  }
+
+  int flush(BridgeStats &stats) {
+    if (count_ == 0) return 0;
+
+    BatchHeader header = {BATCH_MAGIC, 0, count_, (uint32_t)entries_.size()};
+    out_.clear();
+    if (compress_) {
+      uLongf len = compressBound(entries_.size());
+      out_.resize(sizeof(BatchHeader) + len);
+      int r = compress2((Bytef *)out_.data() + sizeof(BatchHeader), &len, (const Bytef *)entries_.data(), entries_.size(), Z_BEST_SPEED);
+      if (r == Z_OK && len < entries_.size()) {
+        header.flags |= BATCH_COMPRESSED;
+        out_.resize(sizeof(BatchHeader) + len);
+      }
+    }
+    if (!(header.flags & BATCH_COMPRESSED)) {
+      out_.resize(sizeof(BatchHeader));
+      out_.insert(out_.end(), entries_.begin(), entries_.end());
+    }
+    memcpy(out_.data(), &header, sizeof(BatchHeader));
+
+    int ret = send_retry(pub_, out_.data(), out_.size(), stats);
+    if (ret >= 0) stats.msgs_out += count_;
+    stats.batches++;
+
+    entries_.clear();
+    count_ = 0;
+    return ret;
+  }
+
+private:
+  PubSocket *pub_;
+  bool compress_;
+  uint16_t count_ = 0;
+  std::vector<char> entries_;
+  std::vector<char> out_;
+};
+
+static void report(BridgeStats &stats, uint64_t elapsed_ns) {
+  double dt = elapsed_ns * 1e-9;
+  printf("bridge: in %lu msgs %.1f KB/s, out %lu msgs %.1f KB/s, capped %lu, send errors %lu, batches %lu (%lu full), busy %.0f%%\n",
+         stats.msgs_in, stats.bytes_in / 1024.0 / dt, stats.msgs_out, stats.bytes_out / 1024.0 / dt,
+         stats.msgs_capped, stats.send_errors, stats.batches, stats.full_batches, 100.0 * stats.busy_ns / elapsed_ns);
+  fflush(stdout);
+  stats = {};
+}
+
+// Forwards every message from the polled sockets, either one zmq/msgq socket per service or into batches
+static void forward(Poller *poller, std::map<SubSocket *, Forward> &forwards, BatchWriter *batch) {
+  BridgeStats stats;
+  std::vector<char> buf;
+  uint64_t last_report = nanos_now();
+
+  while (!do_exit) {
+    auto sockets = poller->poll(100);
+    uint64_t start = nanos_now();
+
+    for (auto sub_sock : sockets) {
+      Forward &f = forwards.at(sub_sock);
+      char *data;
+      size_t size;
+      while (!do_exit && sub_sock->receive_view(&data, &size)) {
+        stats.msgs_in++;
+        stats.bytes_in += size;
+
+        uint64_t t = nanos_now();
+        if (f.min_interval > 0 && t - f.last_forward < f.min_interval) {
+          sub_sock->release_view();
+          stats.msgs_capped++;
+          continue;
+        }
+
+        // Copy before releasing, the writer may overwrite the message while it is read
+        if (batch) {
+          size_t offset = batch->add(f.name, data, size);
+          if (!sub_sock->release_view()) {
+            batch->discard(offset);
+            continue;
+          }
+          if (batch->full()) {
+            batch->flush(stats);
+            stats.full_batches++;
+          }
+        } else {
+          buf.assign(data, data + size);
+          if (!sub_sock->release_view()) continue;
+          if (send_retry(f.pub, buf.data(), buf.size(), stats) >= 0) stats.msgs_out++;
+        }
+        f.last_forward = t;
+      }
+    }
+    if (batch) batch->flush(stats);
+
+    uint64_t end = nanos_now();
+    stats.busy_ns += end - start;
+    if (end - last_report > REPORT_INTERVAL_NS) {
+      report(stats, end - last_report);
+      last_report = end;
+    }
+  }
+}
+
+// The largest batch a sender can produce. It's sent as soon as it reaches MAX_BATCH_SIZE, so it has at most one
+// entry past it, and a msgq message is at most a third of the largest segment.
+static size_t max_batch_size() {
+  size_t max_segment_size = 0;
+  for (const auto &[name, service] : services) {
+    max_segment_size = std::max(max_segment_size, (size_t)service.segment_size);
+  }
+  return MAX_BATCH_SIZE + sizeof(uint8_t) + UINT8_MAX + sizeof(uint32_t) + max_segment_size / 3;
+}
+
+// Unpacks batches from a remote bridge and republishes them on msgq
+static void receive_batches(SubSocket *sub_sock, std::map<std::string, PubSocket *> &pubs) {
+  BridgeStats stats;
+  std::vector<char> buf;
+  uint64_t last_report = nanos_now();
+  const size_t max_size = max_batch_size();
+
+  while (!do_exit) {
+    Message *msg = sub_sock->receive();
+    uint64_t start = nanos_now();
+
+    BatchHeader header;
+    if (msg != NULL && msg->getSize() >= sizeof(BatchHeader)) {
+      memcpy(&header, msg->getData(), sizeof(BatchHeader));
+    } else {
+      header.magic = 0;
+    }
+
+    const char *entries = NULL;
+    const size_t payload_size = header.magic == BATCH_MAGIC ? msg->getSize() - sizeof(BatchHeader) : 0;
+    if (header.magic == BATCH_MAGIC && (header.flags & BATCH_COMPRESSED)) {
+      // the size comes from the peer, only allocate for a batch a sender can produce
+      if (header.size <= max_size && header.size <= payload_size * MAX_DEFLATE_RATIO) {
+        buf.resize(header.size);
+        uLongf len = header.size;
+        int r = uncompress((Bytef *)buf.data(), &len, (const Bytef *)msg->getData() + sizeof(BatchHeader), payload_size);
+        entries = (r == Z_OK && len == header.size) ? buf.data() : NULL;
+      }
+    } else if (header.magic == BATCH_MAGIC && payload_size == header.size) {
+      entries = msg->getData() + sizeof(BatchHeader);
+    }
+
+    if (msg != NULL && entries == NULL) {
+      std::cout << "Warning, dropping invalid batch of " << msg->getSize() << " bytes" << std::endl;
+    }
+
+    size_t pos = 0;
+    for (int i = 0; entries != NULL && i < header.count; i++) {
+      uint8_t name_len;
+      uint32_t size;
+      if (pos + sizeof(name_len) > header.size) break;
+      memcpy(&name_len, entries + pos, sizeof(name_len));
+      pos += sizeof(name_len);
+      if (pos + name_len + sizeof(size) > header.size) break;
+      std::string name(entries + pos, name_len);
+      pos += name_len;
+      memcpy(&size, entries + pos, sizeof(size));
+      pos += sizeof(size);
+      if (pos + size > header.size) break;
+
+      stats.msgs_in++;
+      stats.bytes_in += size;
+      auto it = pubs.find(name);
+      if (it != pubs.end() && send_retry(it->second, (char *)entries + pos, size, stats) >= 0) {
+        stats.msgs_out++;
+      }
+      pos += size;
+    }
+    if (entries != NULL) stats.batches++;
+    delete msg;
+
+    uint64_t end = nanos_now();
+    stats.busy_ns += end - start;
+    if (end - last_report > REPORT_INTERVAL_NS) {
+      report(stats, end - last_report);
+      last_report = end;
+    }
+  }
+}
+
+static BridgeOptions parse_args(int argc, char** argv) {
+  BridgeOptions opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--batch") {
+      opts.batch = true;
+    } else if (arg == "--compress") {
+      opts.compress = true;
+    } else if (arg == "--rate" && i + 1 < argc) {
+      // --rate service=hz, forward at most hz messages per second of that service
+      std::string rate = argv[++i];
+      size_t pos = rate.find('=');
+      if (pos == std::string::npos || atof(rate.c_str() + pos + 1) <= 0) {
+        std::cout << "Warning, ignoring invalid rate: " << rate << std::endl;
+        continue;
+      }
+      opts.rate[rate.substr(0, pos)] = atof(rate.c_str() + pos + 1);
+    } else {
+      opts.args.push_back(arg);
+    }
+  }
+  return opts;
+}
+
+// Usage:
+//   bridge [--batch [--compress]] [--rate service=hz ...]   msgq -> zmq
+//   bridge [--batch] [--rate service=hz ...] <ip> <whitelist>   zmq -> msgq
 int main(int argc, char** argv) {
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
   signal(SIGINT, (sighandler_t)set_do_exit);
   signal(SIGTERM, (sighandler_t)set_do_exit);
 
-  bool zmq_to_msgq = argc > 2;
-  std::string ip = zmq_to_msgq ? argv[1] : "127.0.0.1";
-  std::string whitelist_str = zmq_to_msgq ? std::string(argv[2]) : "";
+  BridgeOptions opts = parse_args(argc, argv);
+  bool zmq_to_msgq = opts.args.size() > 1;
+  std::string ip = zmq_to_msgq ? opts.args[0] : "127.0.0.1";
+  std::string whitelist_str = zmq_to_msgq ? opts.args[1] : "";
 
   Poller *poller;
   Context *pub_context;
@@ -56,37 +354,55 @@ int main(int argc, char** argv) {
     sub_context = new MSGQContext();
   }
 
-  std::map<SubSocket*, PubSocket*> sub2pub;
+  if (zmq_to_msgq && opts.batch) {
+    std::map<std::string, PubSocket*> pubs;
+    for (auto endpoint : get_services(whitelist_str, zmq_to_msgq)) {
+      PubSocket *pub_sock = new MSGQPubSocket();
+      pub_sock->connect(pub_context, endpoint);
+      pubs[endpoint] = pub_sock;
+    }
+
+    ZMQSubSocket sub_sock;
+    int r = sub_sock.connect(sub_context, BATCH_PORT, ip, false, false);
+    assert(r == 0);
+    sub_sock.setTimeout(100);
+    receive_batches(&sub_sock, pubs);
+    return 0;
+  }
+
+  BatchWriter *batch = NULL;
+  if (opts.batch) {
+    PubSocket *batch_sock = new ZMQPubSocket();
+    int r = batch_sock->connect(pub_context, BATCH_PORT, false);
+    assert(r == 0);
+    batch = new BatchWriter(batch_sock, opts.compress);
+  }
+
+  std::map<SubSocket*, Forward> forwards;
   for (auto endpoint : get_services(whitelist_str, zmq_to_msgq)) {
-    PubSocket * pub_sock;
+    Forward f;
+    f.name = endpoint;
+    if (!opts.batch) {
+      f.pub = zmq_to_msgq ? (PubSocket *)new MSGQPubSocket() : (PubSocket *)new ZMQPubSocket();
+      f.pub->connect(pub_context, endpoint);
+    }
+    auto rate = opts.rate.find(endpoint);
+    if (rate != opts.rate.end()) {
+      f.min_interval = 1e9 / rate->second;
+    }
+
     SubSocket * sub_sock;
     if (zmq_to_msgq) {
-      pub_sock = new MSGQPubSocket();
       sub_sock = new ZMQSubSocket();
     } else {
-      pub_sock = new ZMQPubSocket();
       sub_sock = new MSGQSubSocket();
     }
-    pub_sock->connect(pub_context, endpoint);
     sub_sock->connect(sub_context, endpoint, ip, false);
 
     poller->registerSocket(sub_sock);
-    sub2pub[sub_sock] = pub_sock;
+    forwards[sub_sock] = f;
   }
 
-  while (!do_exit) {
-    for (auto sub_sock : poller->poll(100)) {
-      Message * msg = sub_sock->receive();
-      if (msg == NULL) continue;
-      int ret;
-      do {
-        ret = sub2pub[sub_sock]->sendMessage(msg);
-      } while (ret == -1 && errno == EINTR && !do_exit);
-      assert(ret >= 0 || do_exit);
-      delete msg;
-
-      if (do_exit) break;
-    }
-  }
+  forward(poller, forwards, batch);
   return 0;
 }
@@ -54,6 +54,16 @@ public:
 
     return TSubSocket::receive(non_blocking);
   }
+
+  bool receive_view(char **data, size_t *size) override {
+    if (this->state->enabled) {
+      this->recv_called->set();
+      this->recv_ready->wait();
+      this->recv_ready->clear();
+    }
+
+    return TSubSocket::receive_view(data, size);
+  }
 };
 
 class FakePoller: public Poller {
@@ -20,6 +20,14 @@ static bool service_exists(std::string path){
   return services.count(path) > 0;
 }
 
+static size_t get_max_readers(std::string path){
+  return service_exists(path) ? services.at(path).max_readers : DEFAULT_NUM_READERS;
+}
+
+static size_t get_segment_size(std::string path){
+  return service_exists(path) ? services.at(path).segment_size : DEFAULT_SEGMENT_SIZE;
+}
+
 
 MSGQContext::MSGQContext() {
 }
@@ -63,7 +71,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE);
+  int r = msgq_new_queue(q, endpoint.c_str(), get_segment_size(endpoint), get_max_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -136,6 +144,21 @@ Message * MSGQSubSocket::receive(bool non_blocking){
   return (Message*)r;
 }
 
+bool MSGQSubSocket::receive_view(char **data, size_t *size){
+  msgq_msg_t msg;
+  if (msgq_msg_recv_view(&msg, q) <= 0){
+    return false;
+  }
+
+  *data = msg.data;
+  *size = msg.size;
+  return true;
+}
+
+bool MSGQSubSocket::release_view(){
+  return msgq_msg_release_view(q);
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -155,7 +178,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
   }
 
   q = new msgq_queue_t;
-  int r = msgq_new_queue(q, endpoint.c_str(), DEFAULT_SEGMENT_SIZE);
+  int r = msgq_new_queue(q, endpoint.c_str(), get_segment_size(endpoint), get_max_readers(endpoint));
   if (r != 0){
     return r;
   }
@@ -181,6 +204,29 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+int MSGQPubSocket::sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs){
+  std::vector<msgq_msg_t> batch(msgs.size());
+  for (size_t i = 0; i < msgs.size(); i++){
+    batch[i].data = (char *)msgs[i].begin();
+    batch[i].size = msgs[i].size();
+  }
+
+  return msgq_msg_send_batch(batch.data(), batch.size(), q);
+}
+
+char *MSGQPubSocket::reserve(size_t size){
+  reserved_msg.size = size;
+  if (msgq_msg_reserve(&reserved_msg, q) < 0){
+    return NULL;
+  }
+
+  return reserved_msg.data;
+}
+
+int MSGQPubSocket::commit(){
+  return msgq_msg_commit(&reserved_msg, q);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -40,16 +40,22 @@ public:
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
   Message *receive(bool non_blocking=false);
+  bool receive_view(char **data, size_t *size);
+  bool release_view();
   ~MSGQSubSocket();
 };
 
 class MSGQPubSocket : public PubSocket {
 private:
   msgq_queue_t * q = NULL;
+  msgq_msg_t reserved_msg;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  int sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs);
+  char *reserve(size_t size);
+  int commit();
   bool all_readers_updated();
   ~MSGQPubSocket();
 };
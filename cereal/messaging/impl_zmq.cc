@@ -88,11 +88,32 @@ Message * ZMQSubSocket::receive(bool non_blocking){
   return r;
 }
 
+bool ZMQSubSocket::receive_view(char **data, size_t *size){
+  // ZMQ has no shared buffer to borrow from, hold on to an aligned copy instead
+  Message *msg = ZMQSubSocket::receive(true);
+  if (msg == NULL){
+    return false;
+  }
+  delete view_msg;
+  view_msg = msg;
+
+  *data = view_msg->getData();
+  *size = view_msg->getSize();
+  return true;
+}
+
+bool ZMQSubSocket::release_view(){
+  delete view_msg;
+  view_msg = NULL;
+  return true;
+}
+
 void ZMQSubSocket::setTimeout(int timeout){
   zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(int));
 }
 
 ZMQSubSocket::~ZMQSubSocket(){
+  delete view_msg;
   zmq_close(sock);
 }
 
@@ -125,6 +146,23 @@ int ZMQPubSocket::send(char *data, size_t size) {
   return zmq_send(sock, data, size, ZMQ_DONTWAIT);
 }
 
+char *ZMQPubSocket::reserve(size_t size) {
+  if (zmq_msg_init_size(&reserved_msg, size) != 0) {
+    return NULL;
+  }
+  return (char*)zmq_msg_data(&reserved_msg);
+}
+
+int ZMQPubSocket::commit() {
+  assert(pid == getpid());
+  int rc = zmq_msg_send(&reserved_msg, sock, ZMQ_DONTWAIT);
+  if (rc < 0) {
+    // The message is only released on success
+    zmq_msg_close(&reserved_msg);
+  }
+  return rc;
+}
+
 bool ZMQPubSocket::all_readers_updated() {
   assert(false); // TODO not implemented
   return false;
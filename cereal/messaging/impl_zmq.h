@@ -34,11 +34,14 @@ class ZMQSubSocket : public SubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  Message * view_msg = NULL;
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return sock;}
   Message *receive(bool non_blocking=false);
+  bool receive_view(char **data, size_t *size);
+  bool release_view();
   ~ZMQSubSocket();
 };
 
@@ -47,10 +50,13 @@ private:
   void * sock;
   std::string full_endpoint;
   int pid = -1;
+  zmq_msg_t reserved_msg;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit();
   bool all_readers_updated();
   ~ZMQPubSocket();
 };
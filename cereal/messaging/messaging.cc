@@ -82,6 +82,16 @@ PubSocket * PubSocket::create(){
   return s;
 }
 
+int PubSocket::sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs){
+  for (auto &msg : msgs){
+    int r = send((char *)msg.begin(), msg.size());
+    if (r < 0){
+      return r;
+    }
+  }
+  return msgs.size();
+}
+
 PubSocket * PubSocket::create(Context * context, std::string endpoint, bool check_endpoint){
   PubSocket *s = PubSocket::create();
   int r = s->connect(context, endpoint, check_endpoint);
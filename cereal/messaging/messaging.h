@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
@@ -42,6 +43,11 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Non-blocking receive that borrows the message from the socket instead of copying it out.
+  // The data is only valid until release_view(), which returns false if it was overwritten in the meantime.
+  // A view that's still held is released when the next message is received, and kept if there is none.
+  virtual bool receive_view(char **data, size_t *size) = 0;
+  virtual bool release_view() = 0;
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -53,6 +59,12 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Publish several messages at once. Returns the number of messages sent, or -1 on error.
+  virtual int sendBatch(const std::vector<kj::ArrayPtr<capnp::byte>> &msgs);
+  // Publish a message that is written in place: reserve() returns a buffer of the given size
+  // (or NULL on error), and commit() sends what was written to it.
+  virtual char *reserve(size_t size) = 0;
+  virtual int commit() = 0;
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
@@ -89,17 +101,35 @@ public:
   uint64_t rcv_time(const char *name) const;
   cereal::Event::Reader &operator[](const char *name) const;
 
+  // Services are numbered in the order of service_list. Resolve a name once with index()
+  // and use the index in hot loops to skip the name lookup.
+  int index(const char *name) const;
+  bool updated(int idx) const;
+  bool alive(int idx) const;
+  bool valid(int idx) const;
+  uint64_t rcv_frame(int idx) const;
+  uint64_t rcv_time(int idx) const;
+  cereal::Event::Reader &operator[](int idx) const;
+
+  // Called from update() for every new message of the service, after all services are updated
+  void onUpdate(const char *name, std::function<void(const cereal::Event::Reader &)> callback);
+
 private:
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
   Poller *poller_ = nullptr;
   struct SubMessage;
-  std::map<SubSocket *, SubMessage *> messages_;
-  std::map<std::string, SubMessage *> services_;
+  SubMessage *get(const char *name) const;
+  std::vector<SubMessage *> messages_;
+  std::map<SubSocket *, SubMessage *> sockets_;
+  std::map<std::string, SubMessage *, std::less<>> services_;
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
+  // Builds the first segment in zeroed memory owned by the caller. The builder zeroes it again
+  // when destroyed, so the same scratch space can be reused for every message.
+  MessageBuilder(kj::ArrayPtr<capnp::word> first_segment) : capnp::MallocMessageBuilder(first_segment) {}
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
@@ -137,6 +167,8 @@ public:
   PubMaster(const std::vector<const char *> &service_list);
   inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  inline int sendBatch(const char *name, const std::vector<kj::ArrayPtr<capnp::byte>> &msgs) { return sockets_.at(name)->sendBatch(msgs); }
+  int sendBatch(const char *name, const std::vector<MessageBuilder *> &msgs);
   ~PubMaster();
 
 private:
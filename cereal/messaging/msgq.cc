@@ -21,14 +21,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "cereal/messaging/msgq.h"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
-}
-
 uint64_t msgq_get_uid(void){
   std::random_device rd("/dev/urandom");
   std::uniform_int_distribution<uint64_t> distribution(0, std::numeric_limits<uint32_t>::max());
@@ -73,6 +73,24 @@ void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
   q->read_valids[id]->store(true);
   q->read_pointers[id]->store(*q->write_pointer);
+  q->read_seq = q->write_stats->write_count;
+}
+
+// The writer overwrote data before it was read, skip ahead to the write pointer
+static void msgq_reader_overrun(msgq_queue_t * q){
+  msgq_reader_stats_t *stats = q->read_stats[q->reader_id];
+  uint64_t write_count = q->write_stats->write_count;
+  if (write_count > q->read_seq){
+    stats->skipped_count += write_count - q->read_seq;
+  }
+  stats->reset_count++;
+
+  msgq_reset_reader(q);
+}
+
+static void msgq_reader_consumed(msgq_queue_t * q){
+  q->read_stats[q->reader_id]->read_count++;
+  q->read_seq++;
 }
 
 void msgq_wait_for_subscriber(msgq_queue_t *q){
@@ -83,9 +101,13 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
   return;
 }
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
+static size_t msgq_mmap_size(size_t size, size_t max_readers){
+  return sizeof(msgq_header_t) + max_readers * sizeof(msgq_reader_t) + size;
+}
+
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
+  assert(max_readers > 0);
 
   std::string full_path = "/dev/shm/";
   const char* prefix = std::getenv("OPENPILOT_PREFIX");
@@ -100,12 +122,13 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
     return -1;
   }
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
+  size_t mmap_size = msgq_mmap_size(size, max_readers);
+  int rc = ftruncate(fd, mmap_size);
   if (rc < 0){
     close(fd);
     return -1;
   }
-  char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  char * mem = (char*)mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
 
   if (mem == NULL){
@@ -113,32 +136,80 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   q->mmap_p = mem;
 
+#ifdef MADV_HUGEPAGE
+  // Back large queues with transparent huge pages to reduce TLB misses. This needs
+  // /sys/kernel/mm/transparent_hugepage/shmem_enabled set to advise, and is a no-op otherwise.
+  if (size >= HUGEPAGE_SEGMENT_SIZE){
+    madvise(mem, mmap_size, MADV_HUGEPAGE);
+  }
+#endif
+
   msgq_header_t *header = (msgq_header_t *)mem;
+  msgq_reader_t *readers = (msgq_reader_t *)(mem + sizeof(msgq_header_t));
+
+  // A new queue is all zeros and can be used as is. A queue left behind with an older
+  // layout is reset, whoever manages to claim it first does the reset.
+  auto version = reinterpret_cast<std::atomic<uint64_t>*>(&header->version);
+  uint64_t cur_version = *version;
+  if (cur_version != MSGQ_VERSION){
+    msgq_header_t empty = {};
+    bool is_new = memcmp(header, &empty, sizeof(msgq_header_t)) == 0;
+    if (std::atomic_compare_exchange_strong(version, &cur_version, MSGQ_VERSION) && !is_new){
+      std::cout << "Warning, resetting queue with incompatible layout: " << full_path << std::endl;
+      memset(mem + sizeof(uint64_t), 0, sizeof(msgq_header_t) - sizeof(uint64_t) + max_readers * sizeof(msgq_reader_t));
+    }
+  }
+  header->max_readers = max_readers;
 
   // Setup pointers to header segment
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
-
-  for (size_t i = 0; i < NUM_READERS; i++){
-    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
-    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
-    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+  q->notify_seq = reinterpret_cast<std::atomic<uint32_t>*>(&header->notify_seq);
+  q->num_waiters = reinterpret_cast<std::atomic<uint32_t>*>(&header->num_waiters);
+
+  q->read_pointers.resize(max_readers);
+  q->read_valids.resize(max_readers);
+  q->read_uids.resize(max_readers);
+  q->read_waiting.resize(max_readers);
+  q->read_stats.resize(max_readers);
+  for (size_t i = 0; i < max_readers; i++){
+    q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_pointer);
+    q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_valid);
+    q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_uid);
+    q->read_waiting[i] = reinterpret_cast<std::atomic<uint64_t>*>(&readers[i].read_waiting);
+    q->read_stats[i] = &readers[i].stats;
   }
+  q->write_stats = &header->stats;
 
-  q->data = mem + sizeof(msgq_header_t);
+  q->data = (char *)(readers + max_readers);
   q->size = size;
+  q->max_readers = max_readers;
   q->reader_id = -1;
+  q->read_seq = 0;
 
   q->endpoint = path;
   q->read_conflate = false;
+  q->view_active = false;
 
   return 0;
 }
 
+static void msgq_release_reader(msgq_queue_t *q, int id, uint64_t uid){
+  *q->read_valids[id] = false;
+  *q->read_waiting[id] = 0;
+  std::atomic_compare_exchange_strong(q->read_uids[id], &uid, (uint64_t)0);
+}
+
 void msgq_close_queue(msgq_queue_t *q){
   if (q->mmap_p != NULL){
-    munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+    // Give up the reader slot, so it can be reused without evicting anyone
+    int id = q->reader_id;
+    if (id >= 0 && q->read_uid_local == *q->read_uids[id]){
+      msgq_release_reader(q, id, q->read_uid_local);
+    }
+
+    munmap(q->mmap_p, msgq_mmap_size(q->size, q->max_readers));
   }
 }
 
@@ -150,154 +221,379 @@ void msgq_init_publisher(msgq_queue_t * q) {
   *q->write_uid = uid;
   *q->num_readers = 0;
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < q->max_readers; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
+    *q->read_waiting[i] = 0;
   }
 
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
+// Bump the sequence number, and wake whoever sleeps on it
+static void msgq_futex_wake(std::atomic<uint32_t> *seq, std::atomic<uint32_t> *num_waiters) {
+  seq->fetch_add(1);
+
+  #ifdef __linux__
+    if (*num_waiters > 0){
+      syscall(SYS_futex, seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    }
+  #endif
+}
+
+static void msgq_futex_wait(std::atomic<uint32_t> *seq, uint32_t val, const struct timespec *ts) {
+  #ifdef __linux__
+    syscall(SYS_futex, seq, FUTEX_WAIT, val, ts, NULL, 0);
   #else
-    syscall(SYS_tkill, tid, SIGUSR2);
+    // No futex, check again after a short nap
+    struct timespec nap = {0, std::min<long>(ts->tv_sec > 0 ? 1000000 : ts->tv_nsec, 1000000)};
+    nanosleep(&nap, NULL);
   #endif
 }
 
-void msgq_init_subscriber(msgq_queue_t * q) {
-  assert(q != NULL);
-  assert(q->num_readers != NULL);
+// The wake table is the same for all prefixes, the slots are owned by thread ids which are unique anyway
+static msgq_wake_slot_t *msgq_wake_table(){
+  static msgq_wake_slot_t *table = []() -> msgq_wake_slot_t * {
+    const size_t size = MSGQ_WAKE_SLOTS * sizeof(msgq_wake_slot_t);
+    int fd = open("/dev/shm/msgq_wake", O_RDWR | O_CREAT, 0664);
+    if (fd < 0){
+      std::cout << "Warning, could not open the msgq wake table" << std::endl;
+      return NULL;
+    }
+    char *mem = NULL;
+    if (ftruncate(fd, size) == 0){
+      mem = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return (mem == NULL || mem == MAP_FAILED) ? NULL : (msgq_wake_slot_t *)mem;
+  }();
+  return table;
+}
 
-  uint64_t uid = msgq_get_uid();
+static std::atomic<uint64_t> *msgq_wake_slot_uid(msgq_wake_slot_t *slot){
+  return reinterpret_cast<std::atomic<uint64_t>*>(&slot->uid);
+}
 
-  // Get reader id
-  while (true){
-    uint64_t cur_num_readers = *q->num_readers;
-    uint64_t new_num_readers = cur_num_readers + 1;
+// The wake slot of the calling thread, claimed on its first poll of several queues and freed when the thread exits
+struct msgq_wake_owner_t {
+  msgq_wake_slot_t *slot = NULL;
+  uint64_t uid = 0;
 
-    // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
-      //std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
+  ~msgq_wake_owner_t(){
+    if (slot != NULL){
+      std::atomic_compare_exchange_strong(msgq_wake_slot_uid(slot), &uid, (uint64_t)0);
+    }
+  }
+};
 
-      for (size_t i = 0; i < NUM_READERS; i++){
-        *q->read_valids[i] = false;
+static msgq_wake_slot_t *msgq_claim_wake_slot(){
+  thread_local msgq_wake_owner_t owner;
+  msgq_wake_slot_t *table = msgq_wake_table();
+  if (table == NULL){
+    return NULL;
+  }
+  if (owner.slot != NULL && *msgq_wake_slot_uid(owner.slot) == owner.uid){
+    return owner.slot;
+  }
 
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
+  uint64_t uid = msgq_get_uid();
+  for (int pass = 0; pass < 2; pass++){
+    for (size_t i = 0; i < MSGQ_WAKE_SLOTS; i++){
+      uint64_t free_uid = 0;
+      if (std::atomic_compare_exchange_strong(msgq_wake_slot_uid(&table[i]), &free_uid, uid)){
+        owner.slot = &table[i];
+        owner.uid = uid;
+        return owner.slot;
+      }
+    }
 
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+    // Free the slots of threads that exited without giving them up
+    for (size_t i = 0; i < MSGQ_WAKE_SLOTS; i++){
+      uint64_t slot_uid = *msgq_wake_slot_uid(&table[i]);
+      if (slot_uid != 0 && kill(slot_uid & 0xFFFFFFFF, 0) == -1 && errno == ESRCH){
+        std::atomic_compare_exchange_strong(msgq_wake_slot_uid(&table[i]), &slot_uid, (uint64_t)0);
       }
+    }
+  }
+  return NULL;
+}
 
-      continue;
+static void msgq_wake_slot(uint64_t waiting){
+  msgq_wake_slot_t *table = msgq_wake_table();
+  if (table != NULL && waiting > 0 && waiting <= MSGQ_WAKE_SLOTS){
+    msgq_wake_slot_t *slot = &table[waiting - 1];
+    msgq_futex_wake(reinterpret_cast<std::atomic<uint32_t>*>(&slot->seq),
+                    reinterpret_cast<std::atomic<uint32_t>*>(&slot->num_waiters));
+  }
+}
+
+// Readers polling a single queue sleep on the notify_seq futex in the header
+static void msgq_wake_waiters(msgq_queue_t *q) {
+  msgq_futex_wake(q->notify_seq, q->num_waiters);
+}
+
+static void msgq_notify_readers(msgq_queue_t *q, uint64_t num_readers) {
+  msgq_wake_waiters(q);
+
+  // Readers polling several queues sleep on their wake slot, only the ones asleep in msgq_poll have one set
+  for (uint64_t i = 0; i < num_readers; i++){
+    uint64_t waiting = *q->read_waiting[i];
+    if (waiting != 0 && *q->read_uids[i] != 0){
+      msgq_wake_slot(waiting);
     }
+  }
+}
 
+static int msgq_claim_reader(msgq_queue_t * q, uint64_t uid){
+  for (size_t i = 0; i < q->max_readers; i++){
     // Use atomic compare and swap to handle race condition
     // where two subscribers start at the same time
-    if (std::atomic_compare_exchange_strong(q->num_readers,
-                                            &cur_num_readers,
-                                            new_num_readers)){
-      q->reader_id = cur_num_readers;
+    uint64_t free_uid = 0;
+    if (std::atomic_compare_exchange_strong(q->read_uids[i], &free_uid, uid)){
+      // Make sure the writer scans up to this slot
+      uint64_t cur_num_readers = *q->num_readers;
+      while (cur_num_readers < i + 1 &&
+             !std::atomic_compare_exchange_weak(q->num_readers, &cur_num_readers, (uint64_t)(i + 1))){
+      }
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Free the slots of readers that exited without closing the queue
+static int msgq_reclaim_readers(msgq_queue_t * q){
+  int reclaimed = 0;
+  uint64_t num_readers = *q->num_readers;
+  for (uint64_t i = 0; i < num_readers; i++){
+    uint64_t uid = *q->read_uids[i];
+    if (uid != 0 && kill(uid & 0xFFFFFFFF, 0) == -1 && errno == ESRCH){
+      msgq_release_reader(q, i, uid);
+      reclaimed++;
+    }
+  }
+  return reclaimed;
+}
+
+void msgq_init_subscriber(msgq_queue_t * q) {
+  assert(q != NULL);
+  assert(q->num_readers != NULL);
+
+  uint64_t uid = msgq_get_uid();
+
+  // Get reader id
+  while (true){
+    int id = msgq_claim_reader(q, uid);
+    if (id >= 0){
+      q->reader_id = id;
       q->read_uid_local = uid;
 
       // We start with read_valid = false,
       // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
+      *q->read_valids[id] = false;
+      *q->read_pointers[id] = 0;
+      *q->read_waiting[id] = 0;
+      memset(q->read_stats[id], 0, sizeof(msgq_reader_stats_t));
       break;
     }
+
+    if (msgq_reclaim_readers(q) > 0){
+      continue;
+    }
+
+    // No more slots available. Reset all subscribers to kick out inactive ones
+    std::cout << "Warning, no free reader slots, evicting all subscribers: " << q->endpoint << std::endl;
+    *q->num_readers = 0;
+
+    for (size_t i = 0; i < q->max_readers; i++){
+      *q->read_valids[i] = false;
+      *q->read_uids[i] = 0;
+
+      // Wake up reader in case they are in a poll
+      uint64_t waiting = q->read_waiting[i]->exchange(0);
+      msgq_wake_slot(waiting);
+    }
+    msgq_wake_waiters(q);
   }
 
   //std::cout << "New subscriber id: " << q->reader_id << " uid: " << q->read_uid_local << " " << q->endpoint << std::endl;
   msgq_reset_reader(q);
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
-  // Die if we are no longer the active publisher
-  if (q->write_uid_local != *q->write_uid){
-    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
-    errno = EADDRINUSE;
-    return -1;
-  }
-
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
-
-  // We need to fit at least three messages in the queue,
-  // then we can always safely access the last message
-  assert(3 * total_msg_size <= q->size);
+// Find where the next message goes. Returns true if it doesn't fit before the end
+// of the buffer and a wraparound tag has to be written at write_pointer first
+static bool msgq_needs_wraparound(msgq_queue_t *q, uint32_t write_pointer, uint64_t total_msg_size){
+  // Always leave space for a wraparound tag for the next message, including alignment
+  int64_t remaining_space = q->size - write_pointer - total_msg_size - sizeof(int64_t);
+  return remaining_space <= 0;
+}
 
+// Lay out a group of messages at the write pointer, invalidate the readers in that area and write the size
+// (and wraparound) tags. Returns the new write pointer, which publishes the group once the data is in place.
+// The group has to fit in a third of the queue, so it wraps around at most once and never overlaps itself.
+static uint64_t msgq_reserve_group(const msgq_msg_t * msgs, size_t count, msgq_queue_t *q){
   uint64_t num_readers = *q->num_readers;
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
 
-  char *p = q->data + write_pointer; // add base offset
-
-  // Check remaining space
-  // Always leave space for a wraparound tag for the next message, including alignment
-  int64_t remaining_space = q->size - write_pointer - total_msg_size - sizeof(int64_t);
-  if (remaining_space <= 0){
-    // Write -1 size tag indicating wraparound
-    *(int64_t*)p = -1;
-
-    // Invalidate all readers that are beyond the write pointer
-    // TODO: should we handle the case where a new reader shows up while this is running?
-    for (uint64_t i = 0; i < num_readers; i++){
-      uint64_t read_pointer = *q->read_pointers[i];
-      uint64_t read_cycles = read_pointer >> 32;
-      read_pointer &= 0xFFFFFFFF;
-
-      if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
-        *q->read_valids[i] = false;
-      }
+  // Find the area that will be written, and where the wraparound happens (if any)
+  bool wrapped = false;
+  size_t wrap_index = 0;
+  uint32_t wrap_pointer = 0;
+  uint32_t end = write_pointer;
+  for (size_t i = 0; i < count; i++){
+    uint64_t total_msg_size = ALIGN(msgs[i].size + sizeof(int64_t));
+    if (!wrapped && msgq_needs_wraparound(q, end, total_msg_size)){
+      wrapped = true;
+      wrap_index = i;
+      wrap_pointer = end;
+      end = 0;
     }
-
-    // Update global and local copies of write pointer and write_cycles
-    write_pointer = 0;
-    write_cycles = write_cycles + 1;
-    PACK64(*q->write_pointer, write_cycles, write_pointer);
-
-    // Set actual pointer to the beginning of the data segment
-    p = q->data;
+    end += total_msg_size;
   }
 
-  // Invalidate readers that are in the area that will be written
-  uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
-
+  // Invalidate readers that are in the area that will be written. Readers can't move past the
+  // current write pointer, so it's safe to do this for the whole group up front.
+  // TODO: should we handle the case where a new reader shows up while this is running?
+  uint32_t first_end = wrapped ? wrap_pointer : end;
   for (uint64_t i = 0; i < num_readers; i++){
     uint32_t read_cycles, read_pointer;
     UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
+    bool overwritten = (read_pointer >= write_pointer) && (read_pointer < first_end) && (read_cycles != write_cycles);
+    if (wrapped){
+      // Readers that are beyond the wraparound tag, or in the area written after wrapping around
+      overwritten |= (read_pointer > wrap_pointer) && (read_cycles != write_cycles);
+      overwritten |= (read_pointer < end) && (read_cycles != write_cycles + 1);
+    }
+
+    if (overwritten) {
       *q->read_valids[i] = false;
     }
   }
 
+  char *p = q->data + write_pointer; // add base offset
+  for (size_t i = 0; i < count; i++){
+    if (wrapped && i == wrap_index){
+      // Write -1 size tag indicating wraparound
+      *(int64_t*)p = -1;
+
+      // Set actual pointer to the beginning of the data segment
+      p = q->data;
+      write_cycles = write_cycles + 1;
+    }
 
-  // Write size tag
-  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
+    // Write size tag
+    std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+    *size_p = msgs[i].size;
+    p += ALIGN(msgs[i].size + sizeof(int64_t));
+  }
+
+  uint64_t new_write_pointer;
+  PACK64(new_write_pointer, write_cycles, end);
+  return new_write_pointer;
+}
+
+static void msgq_commit_group(msgq_queue_t *q, uint64_t new_write_pointer, size_t count, uint64_t bytes){
+  msgq_writer_stats_t *stats = q->write_stats;
+  stats->write_count += count;
+  stats->write_bytes += bytes;
+  if ((new_write_pointer >> 32) != (*q->write_pointer >> 32)){
+    stats->wraparounds++;
+  }
 
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
   __sync_synchronize();
 
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
-  PACK64(*q->write_pointer, write_cycles, new_ptr);
+  *q->write_pointer = new_write_pointer;
 
   // Notify readers
-  for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+  msgq_notify_readers(q, *q->num_readers);
+}
+
+static bool msgq_check_publisher(msgq_queue_t *q){
+  // Die if we are no longer the active publisher
+  if (q->write_uid_local != *q->write_uid){
+    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
+    errno = EADDRINUSE;
+    return false;
+  }
+  return true;
+}
+
+static void msgq_write_group(const msgq_msg_t * msgs, size_t count, msgq_queue_t *q){
+  uint32_t write_pointer = *q->write_pointer & 0xFFFFFFFF;
+  uint64_t new_write_pointer = msgq_reserve_group(msgs, count, q);
+
+  // Copy data, following the size tags like a reader would
+  char *p = q->data + write_pointer;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < count; i++){
+    if (*(int64_t*)p == -1){
+      p = q->data;
+    }
+    memcpy(p + sizeof(int64_t), msgs[i].data, msgs[i].size);
+    p += ALIGN(msgs[i].size + sizeof(int64_t));
+    bytes += msgs[i].size;
+  }
+
+  msgq_commit_group(q, new_write_pointer, count, bytes);
+}
+
+int msgq_msg_send_batch(msgq_msg_t * msgs, size_t count, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+
+  size_t group_start = 0;
+  uint64_t group_size = 0;
+  for (size_t i = 0; i < count; i++){
+    uint64_t total_msg_size = ALIGN(msgs[i].size + sizeof(int64_t));
+
+    // We need to fit at least three messages in the queue,
+    // then we can always safely access the last message
+    assert(3 * total_msg_size <= q->size);
+
+    // Split the batch into groups of at most a third of the queue
+    if (3 * (group_size + total_msg_size) > q->size){
+      msgq_write_group(msgs + group_start, i - group_start, q);
+      group_start = i;
+      group_size = 0;
+    }
+    group_size += total_msg_size;
   }
 
+  if (group_start < count){
+    msgq_write_group(msgs + group_start, count - group_start, q);
+  }
+
+  return count;
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  int r = msgq_msg_send_batch(msg, 1, q);
+  return (r < 0) ? r : msg->size;
+}
+
+int msgq_msg_reserve(msgq_msg_t * msg, msgq_queue_t *q){
+  if (!msgq_check_publisher(q)){
+    return -1;
+  }
+
+  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+  assert(3 * total_msg_size <= q->size);
+
+  q->reserved_write_pointer = msgq_reserve_group(msg, 1, q);
+
+  // The message ends at the new write pointer
+  uint32_t end = q->reserved_write_pointer & 0xFFFFFFFF;
+  msg->data = q->data + end - total_msg_size + sizeof(int64_t);
+  return msg->size;
+}
+
+int msgq_msg_commit(msgq_msg_t * msg, msgq_queue_t *q){
+  msgq_commit_group(q, q->reserved_write_pointer, 1, msg->size);
   return msg->size;
 }
 
@@ -313,9 +609,15 @@ int msgq_msg_ready(msgq_queue_t * q){
     goto start;
   }
 
+  // A held view counts as read, the next message is the one after it. Whether the view
+  // was overwritten is only checked once it's released.
+  if (q->view_active){
+    return q->view_read_pointer != *q->write_pointer;
+  }
+
   // Check valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
@@ -331,7 +633,9 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+// Locate the next message for this reader without consuming it. Handles eviction, invalidation,
+// wraparound and conflate. Returns the message size, or 0 if no new message is available.
+static int64_t msgq_msg_peek(msgq_queue_t * q, char ** data, uint64_t * next_read_pointer){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
@@ -344,7 +648,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 
   // Check valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
@@ -353,13 +657,11 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
-  UNUSED(write_cycles);
 
   char * p = q->data + read_pointer;
 
   // Check if new message is available
   if (read_pointer == write_pointer) {
-    msg->size = 0;
     return 0;
   }
 
@@ -369,7 +671,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 
   // Check if the size that was read is valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
@@ -392,77 +694,197 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     if (new_read_pointer != write_pointer){
       // Update read pointer
       PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+      q->read_seq++;
       goto start;
     }
   }
 
+  // Keep track of how far behind the writer this reader gets
+  uint64_t lag = (read_cycles == write_cycles) ? write_pointer - read_pointer : q->size - read_pointer + write_pointer;
+  msgq_reader_stats_t *stats = q->read_stats[id];
+  if (lag > stats->max_lag){
+    stats->max_lag = lag;
+  }
+
+  *data = p + sizeof(int64_t);
+  PACK64(*next_read_pointer, read_cycles, new_read_pointer);
+  return size;
+}
+
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+ start:
+  char * data;
+  uint64_t new_read_pointer;
+  int64_t size = msgq_msg_peek(q, &data, &new_read_pointer);
+
+  if (size == 0) {
+    msg->size = 0;
+    return 0;
+  }
+
   // Copy message
   if (msgq_msg_init_size(msg, size) < 0)
     return -1;
 
   __sync_synchronize();
-  memcpy(msg->data, p + sizeof(int64_t), size);
+  memcpy(msg->data, data, size);
   __sync_synchronize();
 
   // Update read pointer
-  PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+  int id = q->reader_id;
+  *q->read_pointers[id] = new_read_pointer;
 
   // Check if the actual data that was copied is valid
   if (!*q->read_valids[id]){
     msgq_msg_close(msg);
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
+  msgq_reader_consumed(q);
+
+  return msg->size;
+}
+
+int msgq_msg_recv_view(msgq_msg_t * msg, msgq_queue_t * q){
+  // A view that is still held is released for the next message, and kept if there is none
+  if (q->view_active){
+    if (!msgq_msg_ready(q)){
+      msg->size = 0;
+      return 0;
+    }
+    msgq_msg_release_view(q);
+  }
 
+  // The message stays in the ring and the read pointer is left on it until it is released,
+  // so a writer lapping the reader will invalidate it like any other unread message
+  int64_t size = msgq_msg_peek(q, &msg->data, &q->view_read_pointer);
+  q->view_active = size > 0;
+  msg->size = size;
 
   return msg->size;
 }
 
+bool msgq_msg_release_view(msgq_queue_t * q){
+  if (!q->view_active){
+    return true;
+  }
+  q->view_active = false;
 
+  // Reader was evicted while holding the view, the slot is no longer ours to update
+  int id = q->reader_id;
+  if (q->read_uid_local != *q->read_uids[id]){
+    return false;
+  }
 
-int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
-  int num = 0;
+  // Move the read pointer first, so an invalidation can't slip in between the check and the update
+  __sync_synchronize();
+  *q->read_pointers[id] = q->view_read_pointer;
 
-  // Check if messages ready
-  for (size_t i = 0; i < nitems; i++) {
-    items[i].revents = msgq_msg_ready(items[i].q);
-    if (items[i].revents) num++;
+  if (!*q->read_valids[id]){
+    msgq_reader_overrun(q);
+    return false;
   }
+  msgq_reader_consumed(q);
+
+  return true;
+}
 
-  int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
 
 
-  while (num == 0) {
-    int ret;
+// Sleep on a futex until a message is ready on one of the items, or the timeout expires. The sequence number
+// is sampled before checking for messages, so a message sent in between makes FUTEX_WAIT return right away.
+static int msgq_poll_wait(msgq_pollitem_t * items, size_t nitems, int timeout,
+                          std::atomic<uint32_t> *seq_p, std::atomic<uint32_t> *num_waiters){
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
 
-    ret = nanosleep(&ts, &ts);
+  while (true) {
+    uint32_t seq = *seq_p;
 
-    // Check if messages ready
+    int num = 0;
     for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
-        num += 1;
-        items[i].revents = 1;
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
+    }
+    if (num > 0){
+      return num;
+    }
+
+    // Without a timeout, still wake up periodically to catch an eviction of this reader
+    auto remaining = std::chrono::nanoseconds(100 * 1000 * 1000);
+    if (timeout != -1){
+      remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0){
+        return 0;
       }
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
-      break;
+    struct timespec ts;
+    ts.tv_sec = remaining.count() / 1000000000;
+    ts.tv_nsec = remaining.count() % 1000000000;
+
+    (*num_waiters)++;
+    msgq_futex_wait(seq_p, seq, &ts);
+    (*num_waiters)--;
+  }
+}
+
+static void msgq_set_waiting(msgq_pollitem_t * items, size_t nitems, uint64_t waiting){
+  for (size_t i = 0; i < nitems; i++) {
+    msgq_queue_t *q = items[i].q;
+    int id = q->reader_id;
+
+    // Don't touch the slot if it was handed to another reader after an eviction
+    if (q->read_uid_local == *q->read_uids[id]){
+      *q->read_waiting[id] = waiting;
     }
   }
+}
 
+int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
+  int num = 0;
+
+  // Check if messages ready
+  for (size_t i = 0; i < nitems; i++) {
+    items[i].revents = msgq_msg_ready(items[i].q);
+    if (items[i].revents) num++;
+  }
+
+  if (num > 0 || timeout == 0){
+    return num;
+  }
+
+  // A single queue is waited for on the futex in its header
+  if (nitems == 1){
+    msgq_queue_t *q = items[0].q;
+    return msgq_poll_wait(items, nitems, timeout, q->notify_seq, q->num_waiters);
+  }
+
+  // Several queues: tell their writers which wake slot to bump, then sleep on it.
+  // If the table is full, fall back to the futex of the first queue and only wake on its messages or the timeout.
+  msgq_wake_slot_t *slot = msgq_claim_wake_slot();
+  if (slot == NULL){
+    msgq_queue_t *q = items[0].q;
+    return msgq_poll_wait(items, nitems, timeout, q->notify_seq, q->num_waiters);
+  }
+
+  msgq_set_waiting(items, nitems, slot - msgq_wake_table() + 1);
+  num = msgq_poll_wait(items, nitems, timeout, reinterpret_cast<std::atomic<uint32_t>*>(&slot->seq),
+                       reinterpret_cast<std::atomic<uint32_t>*>(&slot->num_waiters));
+  msgq_set_waiting(items, nitems, 0);
   return num;
 }
 
 bool msgq_all_readers_updated(msgq_queue_t *q) {
   uint64_t num_readers = *q->num_readers;
+  uint64_t active_readers = 0;
   for (uint64_t i = 0; i < num_readers; i++) {
+    if (*q->read_uids[i] == 0) {
+      continue;
+    }
     if (*q->read_valids[i] && *q->write_pointer != *q->read_pointers[i]) {
       return false;
     }
+    active_readers++;
   }
-  return num_readers > 0;
+  return active_readers > 0;
 }
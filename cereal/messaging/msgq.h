@@ -3,39 +3,94 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <vector>
 #include <atomic>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 12
+#define HUGEPAGE_SEGMENT_SIZE (16 * 1024 * 1024)
+#define DEFAULT_NUM_READERS 16
+// Magic in the upper half, so queues created before the header was versioned are never mistaken for current ones
+#define MSGQ_VERSION ((0x4d534751ULL << 32) | 3)
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNUSED(x) (void)x
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32) | ((uint64_t)lower & 0xFFFFFFFF)
 
+// Counters are only written by the owner of the slot or the publisher,
+// and can be read at any time by tools like msgq_stats
+struct msgq_writer_stats_t {
+  uint64_t write_count;
+  uint64_t write_bytes;
+  uint64_t wraparounds;
+};
+
+struct msgq_reader_stats_t {
+  uint64_t read_count;
+  uint64_t skipped_count; // Messages lost because the writer overran the reader
+  uint64_t reset_count;
+  uint64_t max_lag; // Largest distance to the write pointer seen when reading, in bytes
+};
+
+// Shared memory layout: header, followed by max_readers reader slots, followed by the data
 struct  msgq_header_t {
-  uint64_t num_readers;
+  uint64_t version;
+  uint64_t max_readers;
+  uint64_t num_readers; // Highest reader slot in use + 1
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint32_t notify_seq;
+  uint32_t num_waiters;
+  msgq_writer_stats_t stats;
+};
+
+struct msgq_reader_t {
+  uint64_t read_pointer;
+  uint64_t read_valid;
+  uint64_t read_uid; // 0 if the slot is free
+  uint64_t read_waiting; // Wake slot + 1 of the reader while it polls several queues, 0 otherwise
+  msgq_reader_stats_t stats;
+};
+
+// A thread polling several queues sleeps on its own slot in a table shared by all processes,
+// the writers of those queues bump the sequence number of the slot and wake it
+#define MSGQ_WAKE_SLOTS 1024
+struct msgq_wake_slot_t {
+  uint64_t uid; // Thread owning the slot, 0 if the slot is free
+  uint32_t seq;
+  uint32_t num_waiters;
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint32_t> *notify_seq;
+  std::atomic<uint32_t> *num_waiters;
+  std::vector<std::atomic<uint64_t>*> read_pointers;
+  std::vector<std::atomic<uint64_t>*> read_valids;
+  std::vector<std::atomic<uint64_t>*> read_uids;
+  std::vector<std::atomic<uint64_t>*> read_waiting;
+  msgq_writer_stats_t *write_stats;
+  std::vector<msgq_reader_stats_t*> read_stats;
   char * mmap_p;
   char * data;
   size_t size;
+  size_t max_readers;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
 
+  // Number of messages written up to the read pointer, to count the ones skipped on a reset
+  uint64_t read_seq;
+
+  // Write pointer to publish once the message from msgq_msg_reserve is committed
+  uint64_t reserved_write_pointer;
+
+  // Read pointer to commit once the borrowed message from msgq_msg_recv_view is released
+  bool view_active;
+  uint64_t view_read_pointer;
+
   bool read_conflate;
   std::string endpoint;
 };
@@ -57,13 +112,18 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
-int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
+int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size, size_t max_readers = DEFAULT_NUM_READERS);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_send_batch(msgq_msg_t *msgs, size_t count, msgq_queue_t *q);
+int msgq_msg_reserve(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_commit(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_view(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_release_view(msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cereal/messaging/msgq.h"
+
+// Live overview of all msgq queues: writer throughput, and reads, drops and lag of every reader.
+// Usage: msgq_stats [--once] [service ...]
+
+struct QueueSnapshot {
+  msgq_header_t header;
+  std::vector<msgq_reader_t> readers;
+  size_t size;
+};
+
+static volatile sig_atomic_t do_exit = 0;
+static void set_do_exit(int /*sig*/) {
+  do_exit = 1;
+}
+
+static std::string shm_dir() {
+  std::string dir = "/dev/shm/";
+  const char* prefix = std::getenv("OPENPILOT_PREFIX");
+  if (prefix) {
+    dir += std::string(prefix) + "/";
+  }
+  return dir;
+}
+
+static bool read_queue(const std::string &path, QueueSnapshot *snapshot) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(msgq_header_t)) {
+    close(fd);
+    return false;
+  }
+
+  char *mem = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  bool ok = false;
+  memcpy(&snapshot->header, mem, sizeof(msgq_header_t));
+  size_t table_size = sizeof(msgq_header_t) + snapshot->header.max_readers * sizeof(msgq_reader_t);
+  if (snapshot->header.version == MSGQ_VERSION && table_size <= (size_t)st.st_size) {
+    const msgq_reader_t *readers = (const msgq_reader_t *)(mem + sizeof(msgq_header_t));
+    size_t num_readers = std::min(snapshot->header.num_readers, snapshot->header.max_readers);
+    snapshot->readers.assign(readers, readers + num_readers);
+    snapshot->size = st.st_size - table_size;
+    ok = true;
+  }
+
+  munmap(mem, st.st_size);
+  return ok;
+}
+
+static std::map<std::string, QueueSnapshot> read_queues(const std::vector<std::string> &filter) {
+  std::map<std::string, QueueSnapshot> queues;
+
+  std::string dir = shm_dir();
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) return queues;
+
+  while (struct dirent *entry = readdir(d)) {
+    std::string name = entry->d_name;
+    if (!filter.empty() && std::find(filter.begin(), filter.end(), name) == filter.end()) continue;
+
+    QueueSnapshot snapshot;
+    if (read_queue(dir + name, &snapshot)) {
+      queues[name] = snapshot;
+    }
+  }
+  closedir(d);
+  return queues;
+}
+
+static uint64_t reader_lag(const QueueSnapshot &q, const msgq_reader_t &reader) {
+  uint32_t read_cycles, read_pointer, write_cycles, write_pointer;
+  UNPACK64(read_cycles, read_pointer, reader.read_pointer);
+  UNPACK64(write_cycles, write_pointer, q.header.write_pointer);
+  return (read_cycles == write_cycles) ? write_pointer - read_pointer : q.size - read_pointer + write_pointer;
+}
+
+static void print_queues(const std::map<std::string, QueueSnapshot> &queues,
+                         const std::map<std::string, QueueSnapshot> &prev, double dt) {
+  printf("%-28s %8s %9s %10s %8s %8s\n", "queue", "size(KB)", "msgs/s", "KB/s", "wraps", "readers");
+  for (const auto &[name, q] : queues) {
+    const msgq_writer_stats_t &stats = q.header.stats;
+
+    double msgs_per_sec = 0, kb_per_sec = 0;
+    auto it = prev.find(name);
+    if (it != prev.end() && dt > 0) {
+      const msgq_writer_stats_t &prev_stats = it->second.header.stats;
+      msgs_per_sec = (stats.write_count - prev_stats.write_count) / dt;
+      kb_per_sec = (stats.write_bytes - prev_stats.write_bytes) / 1024.0 / dt;
+    }
+
+    int active = std::count_if(q.readers.begin(), q.readers.end(), [](auto &r) { return r.read_uid != 0; });
+    printf("%-28s %8zu %9.1f %10.1f %8" PRIu64 " %5d/%-3" PRIu64 "\n", name.c_str(), q.size / 1024, msgs_per_sec, kb_per_sec,
+           stats.wraparounds, active, q.header.max_readers);
+
+    for (size_t i = 0; i < q.readers.size(); i++) {
+      const msgq_reader_t &r = q.readers[i];
+      if (r.read_uid == 0) continue;
+
+      printf("  reader %2zu tid %-7u read %-10" PRIu64 " skipped %-8" PRIu64 " resets %-6" PRIu64
+             " lag %-8" PRIu64 " max lag %" PRIu64 "\n",
+             i, (uint32_t)(r.read_uid & 0xFFFFFFFF), r.stats.read_count, r.stats.skipped_count,
+             r.stats.reset_count, reader_lag(q, r), r.stats.max_lag);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  signal(SIGINT, set_do_exit);
+  signal(SIGTERM, set_do_exit);
+
+  bool once = false;
+  std::vector<std::string> filter;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--once") {
+      once = true;
+    } else {
+      filter.push_back(arg);
+    }
+  }
+
+  std::map<std::string, QueueSnapshot> prev;
+  auto prev_time = std::chrono::steady_clock::now();
+  while (!do_exit) {
+    auto queues = read_queues(filter);
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - prev_time).count();
+
+    if (!once) printf("\033[2J\033[H");
+    print_queues(queues, prev, dt);
+    fflush(stdout);
+    if (once) break;
+
+    prev = std::move(queues);
+    prev_time = now;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+  return 0;
+}
@@ -1,3 +1,6 @@
+#include <chrono>
+#include <thread>
+
 #include "catch2/catch.hpp"
 #include "cereal/messaging/msgq.h"
 
@@ -392,3 +395,328 @@ TEST_CASE("1 publisher, 2 subscribers", "[integration]"){
     msgq_msg_close(&msg2);
   }
 }
+
+TEST_CASE("Read message view", "[integration]"){
+  remove("/dev/shm/test_queue");
+  const size_t msg_size = 128;
+  msgq_queue_t writer, reader;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  msgq_msg_t outgoing_msg;
+  msgq_msg_init_size(&outgoing_msg, msg_size);
+
+  for (size_t i = 0; i < msg_size; i++){
+    outgoing_msg.data[i] = i;
+  }
+
+  REQUIRE(msgq_msg_send(&outgoing_msg, &writer) == msg_size);
+
+  SECTION("View points into the queue and is aligned"){
+    msgq_msg_t view;
+    REQUIRE(msgq_msg_recv_view(&view, &reader) == msg_size);
+    REQUIRE(view.data == reader.data + sizeof(int64_t));
+    REQUIRE(((uintptr_t)view.data % 8) == 0);
+    REQUIRE(memcmp(view.data, outgoing_msg.data, msg_size) == 0);
+
+    // Not consumed until released, but a held view counts as read
+    REQUIRE(*reader.read_pointers[0] != *writer.write_pointer);
+    REQUIRE(!msgq_msg_ready(&reader));
+    REQUIRE(msgq_msg_release_view(&reader));
+    REQUIRE(*reader.read_pointers[0] == *writer.write_pointer);
+
+    msgq_msg_t incoming_msg;
+    REQUIRE(msgq_msg_recv(&incoming_msg, &reader) == 0);
+    msgq_msg_close(&incoming_msg);
+  }
+  SECTION("View overwritten by writer"){
+    msgq_msg_t view;
+    REQUIRE(msgq_msg_recv_view(&view, &reader) == msg_size);
+
+    // Lap the reader while the view is held
+    for (int i = 0; i < 8; i++){
+      msgq_msg_send(&outgoing_msg, &writer);
+    }
+
+    REQUIRE(!msgq_msg_release_view(&reader));
+    REQUIRE(*reader.read_valids[0] == true);
+  }
+  SECTION("Held view is replaced by the next message"){
+    msgq_msg_t view, next_view;
+    REQUIRE(msgq_msg_recv_view(&view, &reader) == msg_size);
+
+    // Kept while there's nothing newer
+    REQUIRE(msgq_msg_recv_view(&next_view, &reader) == 0);
+    REQUIRE(reader.view_active);
+
+    REQUIRE(msgq_msg_send(&outgoing_msg, &writer) == msg_size);
+    REQUIRE(msgq_msg_ready(&reader));
+    REQUIRE(msgq_msg_recv_view(&next_view, &reader) == msg_size);
+    REQUIRE(next_view.data != view.data);
+    REQUIRE(msgq_msg_release_view(&reader));
+    REQUIRE(!msgq_msg_ready(&reader));
+  }
+
+  msgq_msg_close(&outgoing_msg);
+}
+
+TEST_CASE("Poll wakes up on new message", "[integration]"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t writer, reader;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  msgq_pollitem_t items[1];
+  items[0].q = &reader;
+  REQUIRE(msgq_poll(items, 1, 0) == 0);
+
+  std::thread sender([&writer]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    msgq_msg_t msg;
+    msgq_msg_init_size(&msg, 128);
+    msgq_msg_send(&msg, &writer);
+    msgq_msg_close(&msg);
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(msgq_poll(items, 1, 5000) == 1);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  sender.join();
+
+  REQUIRE(items[0].revents == 1);
+  REQUIRE(elapsed < std::chrono::milliseconds(1000));
+  REQUIRE(*writer.num_waiters == 0);
+  REQUIRE(*reader.read_waiting[0] == false);
+}
+
+TEST_CASE("Poll on several queues wakes up on new message", "[integration]"){
+  remove("/dev/shm/test_queue");
+  remove("/dev/shm/test_queue_2");
+  msgq_queue_t writer, reader, writer_2, reader_2;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_new_queue(&writer_2, "test_queue_2", 1024);
+  msgq_new_queue(&reader_2, "test_queue_2", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+  msgq_init_publisher(&writer_2);
+  msgq_init_subscriber(&reader_2);
+
+  msgq_pollitem_t items[2];
+  items[0].q = &reader;
+  items[1].q = &reader_2;
+  REQUIRE(msgq_poll(items, 2, 0) == 0);
+
+  std::thread sender([&writer_2]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    msgq_msg_t msg;
+    msgq_msg_init_size(&msg, 128);
+    msgq_msg_send(&msg, &writer_2);
+    msgq_msg_close(&msg);
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  REQUIRE(msgq_poll(items, 2, 5000) == 1);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  sender.join();
+
+  REQUIRE(items[0].revents == 0);
+  REQUIRE(items[1].revents == 1);
+  REQUIRE(elapsed < std::chrono::milliseconds(1000));
+  REQUIRE(*reader.read_waiting[0] == 0);
+  REQUIRE(*reader_2.read_waiting[0] == 0);
+}
+
+TEST_CASE("Write batch, read all", "[integration]"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t writer, reader;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  // Large enough to be split up and to wrap around a few times
+  for (uint64_t batch = 0; batch < 10; batch++){
+    const size_t count = 20;
+    uint64_t values[count];
+    msgq_msg_t msgs[count];
+    for (size_t i = 0; i < count; i++){
+      values[i] = batch * count + i;
+      msgs[i].data = (char*)&values[i];
+      msgs[i].size = sizeof(uint64_t);
+    }
+
+    REQUIRE(msgq_msg_send_batch(msgs, count, &writer) == count);
+
+    for (size_t i = 0; i < count; i++){
+      msgq_msg_t msg;
+      REQUIRE(msgq_msg_recv(&msg, &reader) == sizeof(uint64_t));
+      REQUIRE(*(uint64_t*)msg.data == values[i]);
+      msgq_msg_close(&msg);
+    }
+
+    msgq_msg_t msg;
+    REQUIRE(msgq_msg_recv(&msg, &reader) == 0);
+    msgq_msg_close(&msg);
+  }
+
+  REQUIRE((*writer.write_pointer >> 32) > 0);
+}
+
+TEST_CASE("msgq_msg_send_batch invalidates lagging reader"){
+  remove("/dev/shm/test_queue");
+  msgq_queue_t writer, reader;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  msgq_msg_t msgs[2];
+  for (auto &msg : msgs){
+    msgq_msg_init_size(&msg, 120);
+  }
+
+  // Fill up the queue without reading, until the writer is about to lap the reader
+  for (int i = 0; i < 3; i++){
+    REQUIRE(msgq_msg_send_batch(msgs, 2, &writer) == 2);
+  }
+  REQUIRE(*reader.read_valids[0] == true);
+
+  REQUIRE(msgq_msg_send_batch(msgs, 2, &writer) == 2);
+  REQUIRE(*reader.read_valids[0] == false);
+
+  for (auto &msg : msgs){
+    msgq_msg_close(&msg);
+  }
+}
+
+TEST_CASE("msgq_init_subscriber reuses closed reader slots"){
+  remove("/dev/shm/test_queue");
+  const size_t max_readers = 24;
+  msgq_queue_t writer;
+  msgq_new_queue(&writer, "test_queue", 1024, max_readers);
+  msgq_init_publisher(&writer);
+
+  // More readers than the old fixed limit of 12
+  std::vector<msgq_queue_t> readers(max_readers);
+  for (size_t i = 0; i < max_readers; i++){
+    msgq_new_queue(&readers[i], "test_queue", 1024, max_readers);
+    msgq_init_subscriber(&readers[i]);
+    REQUIRE(readers[i].reader_id == i);
+  }
+  REQUIRE(*writer.num_readers == max_readers);
+
+  // Closing a reader frees its slot for the next one, without evicting anyone
+  msgq_close_queue(&readers[5]);
+  REQUIRE(*writer.read_uids[5] == 0);
+
+  msgq_queue_t reader;
+  msgq_new_queue(&reader, "test_queue", 1024, max_readers);
+  msgq_init_subscriber(&reader);
+  REQUIRE(reader.reader_id == 5);
+  REQUIRE(*writer.num_readers == max_readers);
+
+  for (size_t i = 0; i < max_readers; i++){
+    if (i != 5){
+      REQUIRE(*writer.read_uids[i] == readers[i].read_uid_local);
+    }
+  }
+}
+
+TEST_CASE("Reserve and commit message in place", "[integration]"){
+  remove("/dev/shm/test_queue");
+  const size_t msg_size = 120;
+  msgq_queue_t writer, reader;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  // Enough messages to wrap around
+  for (uint64_t i = 0; i < 20; i++){
+    msgq_msg_t outgoing_msg;
+    outgoing_msg.size = msg_size;
+    REQUIRE(msgq_msg_reserve(&outgoing_msg, &writer) == msg_size);
+    REQUIRE(outgoing_msg.data > writer.data);
+    REQUIRE(outgoing_msg.data + msg_size <= writer.data + writer.size);
+
+    memset(outgoing_msg.data, i, msg_size);
+
+    // Not visible until committed
+    REQUIRE(!msgq_msg_ready(&reader));
+    REQUIRE(msgq_msg_commit(&outgoing_msg, &writer) == msg_size);
+
+    msgq_msg_t incoming_msg;
+    REQUIRE(msgq_msg_recv(&incoming_msg, &reader) == msg_size);
+    REQUIRE(incoming_msg.data[0] == (char)i);
+    REQUIRE(incoming_msg.data[msg_size - 1] == (char)i);
+    msgq_msg_close(&incoming_msg);
+  }
+
+  REQUIRE((*writer.write_pointer >> 32) > 0);
+}
+
+TEST_CASE("Reader and writer stats", "[integration]"){
+  remove("/dev/shm/test_queue");
+  const size_t msg_size = 120;
+  msgq_queue_t writer, reader;
+
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  msgq_msg_t outgoing_msg;
+  msgq_msg_init_size(&outgoing_msg, msg_size);
+
+  // Overrun the reader
+  for (int i = 0; i < 10; i++){
+    msgq_msg_send(&outgoing_msg, &writer);
+  }
+
+  msgq_msg_t incoming_msg;
+  REQUIRE(msgq_msg_recv(&incoming_msg, &reader) == 0);
+  msgq_msg_close(&incoming_msg);
+
+  msgq_reader_stats_t *stats = reader.read_stats[reader.reader_id];
+  REQUIRE(stats->read_count == 0);
+  REQUIRE(stats->reset_count == 1);
+  REQUIRE(stats->skipped_count == 10);
+
+  // Keep up with the writer
+  for (int i = 0; i < 2; i++){
+    msgq_msg_send(&outgoing_msg, &writer);
+  }
+  for (int i = 0; i < 2; i++){
+    REQUIRE(msgq_msg_recv(&incoming_msg, &reader) == msg_size);
+    msgq_msg_close(&incoming_msg);
+  }
+
+  REQUIRE(stats->read_count == 2);
+  REQUIRE(stats->reset_count == 1);
+  REQUIRE(stats->skipped_count == 10);
+  REQUIRE(stats->max_lag == 2 * (msg_size + sizeof(int64_t)));
+
+  REQUIRE(writer.write_stats->write_count == 12);
+  REQUIRE(writer.write_stats->write_bytes == 12 * msg_size);
+  REQUIRE(writer.write_stats->wraparounds == 1);
+
+  msgq_msg_close(&outgoing_msg);
+}
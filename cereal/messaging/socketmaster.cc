@@ -1,8 +1,10 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <string>
 #include <mutex>
+#include <stdexcept>
 
 #include "cereal/services.h"
 #include "cereal/messaging/messaging.h"
@@ -46,8 +48,10 @@ struct SubMaster::SubMessage {
   void *allocated_msg_reader = nullptr;
   bool is_polled = false;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  AlignedBuffer aligned_buf;
+  AlignedBuffer aligned_buf[2];
+  int buf_idx = 0;
   cereal::Event::Reader event;
+  std::vector<std::function<void(const cereal::Event::Reader &)>> callbacks;
 };
 
 SubMaster::SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &poll,
@@ -69,21 +73,20 @@ SubMaster::SubMaster(const std::vector<const char *> &service_list, const std::v
       .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader)),
       .is_polled = is_polled};
     m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
-    messages_[socket] = m;
+    messages_.push_back(m);
+    sockets_[socket] = m;
     services_[name] = m;
   }
 }
 
 void SubMaster::update(int timeout) {
-  for (auto &kv : messages_) kv.second->updated = false;
+  for (auto m : messages_) m->updated = false;
 
   auto sockets = poller_->poll(timeout);
 
   // add non-polled sockets for non-blocking receive
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
-    SubSocket *s = kv.first;
-    if (!m->is_polled) sockets.push_back(s);
+  for (auto m : messages_) {
+    if (!m->is_polled) sockets.push_back(m->socket);
   }
 
   uint64_t current_time = nanos_since_boot();
@@ -91,16 +94,27 @@ void SubMaster::update(int timeout) {
   std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
 
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
-    if (msg == nullptr) continue;
-
-    SubMessage *m = messages_.at(s);
+    SubMessage *m = sockets_.at(s);
+
+    // The message is parsed where it is, and the view is held until the next message of the socket
+    // replaces it. Messages in the msgq ring and in a ZMQ message are always word aligned.
+    char *data;
+    size_t size;
+    if (!s->receive_view(&data, &size)) continue;
+
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+    if ((uintptr_t)data % sizeof(capnp::word) != 0) {
+      // Otherwise copy into the spare buffer. The current one stays untouched until the copy
+      // is known to be valid, since m->event may still point into it.
+      words = m->aligned_buf[!m->buf_idx].align(data, size);
+      if (!s->release_view()) continue;
+      m->buf_idx = !m->buf_idx;
+    }
 
     m->msg_reader->~FlatArrayMessageReader();
     capnp::ReaderOptions options;
     options.traversalLimitInWords = kj::maxValue; // Don't limit
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), options);
-    delete msg;
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words, options);
     messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
   }
 
@@ -125,22 +139,26 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
   }
 
   if (!SIMULATION) {
-    for (auto &kv : messages_) {
-      SubMessage *m = kv.second;
+    for (auto m : messages_) {
       m->alive = (m->freq <= (1e-5) || ((current_time - m->rcv_time) * (1e-9)) < (10.0 / m->freq));
     }
   }
+
+  for (auto m : messages_) {
+    if (!m->updated) continue;
+    for (auto &callback : m->callbacks) callback(m->event);
+  }
 }
 
 bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid, bool alive) {
-  int found = 0;
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
-    if (service_list.size() == 0 || inList(service_list, m->name.c_str())) {
-      found += (!valid || m->valid) && (!alive || (m->alive || m->ignore_alive));
-    }
+  auto ok = [=](const SubMessage *m) { return (!valid || m->valid) && (!alive || (m->alive || m->ignore_alive)); };
+  if (service_list.size() == 0) {
+    return std::all_of(messages_.begin(), messages_.end(), ok);
   }
-  return service_list.size() == 0 ? found == messages_.size() : found == service_list.size();
+  return std::all_of(service_list.begin(), service_list.end(), [&](const char *name) {
+    auto it = services_.find(name);
+    return it != services_.end() && ok(it->second);
+  });
 }
 
 void SubMaster::drain() {
@@ -150,40 +168,81 @@ void SubMaster::drain() {
       break;
 
     for (auto sock : polls) {
-      Message *msg = sock->receive(true);
-      delete msg;
+      char *data;
+      size_t size;
+      if (sock->receive_view(&data, &size)) {
+        sock->release_view();
+      }
     }
   }
 }
 
+SubMaster::SubMessage *SubMaster::get(const char *name) const {
+  auto it = services_.find(name);
+  if (it == services_.end()) throw std::out_of_range(std::string("SubMaster: unknown service ") + name);
+  return it->second;
+}
+
 bool SubMaster::updated(const char *name) const {
-  return services_.at(name)->updated;
+  return get(name)->updated;
 }
 
 bool SubMaster::alive(const char *name) const {
-  return services_.at(name)->alive;
+  return get(name)->alive;
 }
 
 bool SubMaster::valid(const char *name) const {
-  return services_.at(name)->valid;
+  return get(name)->valid;
 }
 
 uint64_t SubMaster::rcv_frame(const char *name) const {
-  return services_.at(name)->rcv_frame;
+  return get(name)->rcv_frame;
 }
 
 uint64_t SubMaster::rcv_time(const char *name) const {
-  return services_.at(name)->rcv_time;
+  return get(name)->rcv_time;
 }
 
 cereal::Event::Reader &SubMaster::operator[](const char *name) const {
-  return services_.at(name)->event;
+  return get(name)->event;
+}
+
+int SubMaster::index(const char *name) const {
+  SubMessage *m = get(name);
+  return std::find(messages_.begin(), messages_.end(), m) - messages_.begin();
+}
+
+bool SubMaster::updated(int idx) const {
+  return messages_[idx]->updated;
+}
+
+bool SubMaster::alive(int idx) const {
+  return messages_[idx]->alive;
+}
+
+bool SubMaster::valid(int idx) const {
+  return messages_[idx]->valid;
+}
+
+uint64_t SubMaster::rcv_frame(int idx) const {
+  return messages_[idx]->rcv_frame;
+}
+
+uint64_t SubMaster::rcv_time(int idx) const {
+  return messages_[idx]->rcv_time;
+}
+
+cereal::Event::Reader &SubMaster::operator[](int idx) const {
+  return messages_[idx]->event;
+}
+
+void SubMaster::onUpdate(const char *name, std::function<void(const cereal::Event::Reader &)> callback) {
+  get(name)->callbacks.push_back(std::move(callback));
 }
 
 SubMaster::~SubMaster() {
   delete poller_;
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
+  for (auto m : messages_) {
     m->msg_reader->~FlatArrayMessageReader();
     free(m->allocated_msg_reader);
     delete m->socket;
@@ -201,8 +260,24 @@ PubMaster::PubMaster(const std::vector<const char *> &service_list) {
 }
 
 int PubMaster::send(const char *name, MessageBuilder &msg) {
-  auto bytes = msg.toBytes();
-  return send(name, bytes.begin(), bytes.size());
+  PubSocket *socket = sockets_.at(name);
+
+  // Serialize straight into the socket's buffer, saving the intermediate flat array
+  size_t size = msg.getSerializedSize();
+  char *buf = socket->reserve(size);
+  if (buf == nullptr) return -1;
+
+  msg.serializeToBuffer((unsigned char *)buf, size);
+  return socket->commit();
+}
+
+int PubMaster::sendBatch(const char *name, const std::vector<MessageBuilder *> &msgs) {
+  std::vector<kj::ArrayPtr<capnp::byte>> batch;
+  batch.reserve(msgs.size());
+  for (auto msg : msgs) {
+    batch.push_back(msg->toBytes());
+  }
+  return sendBatch(name, batch);
 }
 
 PubMaster::~PubMaster() {
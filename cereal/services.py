@@ -3,6 +3,8 @@ from typing import Optional
 
 RESERVED_PORT = 8022  # sshd
 STARTING_PORT = 8001
+DEFAULT_MAX_READERS = 16
+DEFAULT_SEGMENT_SIZE = 10 * 1024 * 1024
 
 
 def new_port(port: int):
@@ -11,11 +13,14 @@ def new_port(port: int):
 
 
 class Service:
-  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
+  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None,
+               max_readers: int = DEFAULT_MAX_READERS, segment_size: int = DEFAULT_SEGMENT_SIZE):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.max_readers = max_readers
+    self.segment_size = segment_size
 
 
 services: dict[str, tuple] = {
@@ -105,9 +110,54 @@ services: dict[str, tuple] = {
   "customReservedRawData0": (True, 0.),
   "customReservedRawData1": (True, 0.),
   "customReservedRawData2": (True, 0.),
+  "encoderStats": (True, 1., 1),
 }
-SERVICE_LIST = {name: Service(new_port(idx), *vals) for
-                idx, (name, vals) in enumerate(services.items())}
+# size of the msgq reader table, for services with many subscribers (ui, loggerd, bridges, tools, ...)
+max_readers: dict[str, int] = {
+  "can": 32,
+  "carState": 32,
+  "carControl": 32,
+  "controlsState": 32,
+  "deviceState": 32,
+  "liveCalibration": 32,
+  "liveLocationKalman": 32,
+  "modelV2": 32,
+  "pandaStates": 32,
+  "roadCameraState": 32,
+}
+
+# size of the msgq ring buffer, must hold several seconds of the largest messages of the service
+segment_size: dict[str, int] = {
+  # video streams, I-frames can be several hundred KB
+  "roadEncodeData": 32 * 1024 * 1024,
+  "wideRoadEncodeData": 32 * 1024 * 1024,
+  "driverEncodeData": 16 * 1024 * 1024,
+  "livestreamRoadEncodeData": 16 * 1024 * 1024,
+  "livestreamWideRoadEncodeData": 16 * 1024 * 1024,
+  "livestreamDriverEncodeData": 16 * 1024 * 1024,
+
+  # small messages at a few Hz or less
+  "temperatureSensor": 1024 * 1024,
+  "temperatureSensor2": 1024 * 1024,
+  "deviceState": 1024 * 1024,
+  "peripheralState": 1024 * 1024,
+  "liveCalibration": 1024 * 1024,
+  "liveTorqueParameters": 1024 * 1024,
+  "gpsLocation": 1024 * 1024,
+  "clocks": 1024 * 1024,
+  "onroadEvents": 1024 * 1024,
+  "carParams": 1024 * 1024,
+  "managerState": 1024 * 1024,
+  "uploaderState": 1024 * 1024,
+  "navInstruction": 1024 * 1024,
+  "userFlag": 1024 * 1024,
+  "frogpilotDeviceState": 1024 * 1024,
+  "frogpilotNavigation": 1024 * 1024,
+}
+
+SERVICE_LIST = {name: Service(new_port(idx), *vals, max_readers=max_readers.get(name, DEFAULT_MAX_READERS),
+                              segment_size=segment_size.get(name, DEFAULT_SEGMENT_SIZE))
+                for idx, (name, vals) in enumerate(services.items())}
 
 
 def build_header():
@@ -119,13 +169,13 @@ def build_header():
   h += "#include <map>\n"
   h += "#include <string>\n"
 
-  h += "struct service { std::string name; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "struct service { std::string name; int port; bool should_log; int frequency; int decimation; int max_readers; int segment_size; };\n"
   h += "static std::map<std::string, service> services = {\n"
   for k, v in SERVICE_LIST.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { "%s", {"%s", %d, %s, %d, %d}},\n' % \
-         (k, k, v.port, should_log, v.frequency, decimation)
+    h += '  { "%s", {"%s", %d, %s, %d, %d, %d, %d}},\n' % \
+         (k, k, v.port, should_log, v.frequency, decimation, v.max_readers, v.segment_size)
   h += "};\n"
 
   h += "#endif\n"
@@ -693,6 +693,7 @@ int Localizer::locationd_thread() {
 
   SubMaster sm(service_list, {}, nullptr, {gps_location_socket});
   PubMaster pm({"liveLocationKalman"});
+  const int trigger_msg = sm.index("cameraOdometry");
 
   uint64_t cnt = 0;
   bool filterInitialized = false;
@@ -705,9 +706,9 @@ int Localizer::locationd_thread() {
     sm.update();
     if (filterInitialized){
       this->observation_timings_invalid_reset();
-      for (const char* service : service_list) {
-        if (sm.updated(service) && sm.valid(service)){
-          const cereal::Event::Reader log = sm[service];
+      for (int i = 0; i < service_list.size(); i++) {
+        if (sm.updated(i) && sm.valid(i)){
+          const cereal::Event::Reader log = sm[i];
           this->handle_msg(log);
         }
       }
@@ -715,7 +716,6 @@ int Localizer::locationd_thread() {
       filterInitialized = sm.allAliveAndValid();
     }
 
-    const char* trigger_msg = "cameraOdometry";
     if (sm.updated(trigger_msg)) {
       bool inputsOK = sm.allValid() && this->are_inputs_ok();
       bool gpsOK = this->is_gps_ok();
@@ -1,5 +1,11 @@
 #include "system/loggerd/encoder/encoder.h"
 
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "common/timing.h"
+
 VideoEncoder::VideoEncoder(const EncoderInfo &encoder_info, int in_width, int in_height)
     : encoder_info(encoder_info), in_width(in_width), in_height(in_height) {
 
@@ -40,4 +46,42 @@ void VideoEncoder::publisher_publish(VideoEncoder *e, int segment_num, uint32_t
   kj::ArrayOutputStream output_stream(kj::ArrayPtr<capnp::byte>(e->msg_cache.data(), bytes_size));
   capnp::writeMessage(output_stream, msg);
   e->pm->send(e->encoder_info.publish_name, e->msg_cache.data(), bytes_size);
+
+  double now = millis_since_boot();
+  std::lock_guard lk(e->stats_lock);
+  VideoEncoderStats &st = e->stats;
+  st.frames_out++;
+  st.bytes_out += dat.size();
+  double latency = now - extra.timestamp_eof / 1e6;
+  st.latency_ms_total += latency;
+  st.latency_ms_max = std::max(st.latency_ms_max, latency);
+
+  auto it = e->frames_in_flight.find(extra.frame_id);
+  if (it != e->frames_in_flight.end()) {
+    // frames go through in order, the ones given to the encoder before this one are lost
+    st.frames_dropped += std::distance(e->frames_in_flight.begin(), it);
+    double encode_ms = now - it->second;
+    st.encode_ms_total += encode_ms;
+    st.encode_ms_max = std::max(st.encode_ms_max, encode_ms);
+    const double buckets[] = {5, 10, 20, 50, 100};
+    st.encode_ms_histogram[std::upper_bound(std::begin(buckets), std::end(buckets), encode_ms) - std::begin(buckets)]++;
+    e->frames_in_flight.erase(e->frames_in_flight.begin(), std::next(it));
+  }
+}
+
+void VideoEncoder::record_frame_in(uint32_t frame_id) {
+  std::lock_guard lk(stats_lock);
+  stats.frames_in++;
+  frames_in_flight[frame_id] = millis_since_boot();
+  stats.queue_depth_max = std::max(stats.queue_depth_max, (uint32_t)frames_in_flight.size());
+}
+
+void VideoEncoder::record_frame_lagged() {
+  std::lock_guard lk(stats_lock);
+  stats.frames_lagged++;
+}
+
+VideoEncoderStats VideoEncoder::take_stats() {
+  std::lock_guard lk(stats_lock);
+  return std::exchange(stats, {});
 }
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
@@ -14,6 +17,16 @@
 
 #define V4L2_BUF_FLAG_KEYFRAME 8
 
+// Collected since the last VideoEncoder::take_stats(), see EncoderStats in log.capnp
+struct VideoEncoderStats {
+  uint32_t frames_in = 0, frames_out = 0, frames_dropped = 0, frames_lagged = 0;
+  uint32_t queue_depth_max = 0;
+  uint64_t bytes_out = 0;
+  double latency_ms_total = 0, latency_ms_max = 0;
+  double encode_ms_total = 0, encode_ms_max = 0;
+  std::array<uint32_t, 6> encode_ms_histogram = {};  // <5, <10, <20, <50, <100, >=100 ms
+};
+
 class VideoEncoder {
 public:
   VideoEncoder(const EncoderInfo &encoder_info, int in_width, int in_height);
@@ -24,6 +37,12 @@ public:
 
   void publisher_publish(VideoEncoder *e, int segment_num, uint32_t idx, VisionIpcBufExtra &extra, unsigned int flags, kj::ArrayPtr<capnp::byte> header, kj::ArrayPtr<capnp::byte> dat);
 
+  // encoderd reports the frames it reads for this encoder, publisher_publish() records the rest
+  void record_frame_in(uint32_t frame_id);
+  void record_frame_lagged();
+  VideoEncoderStats take_stats();
+  inline const char *publish_name() const { return encoder_info.publish_name; }
+
 protected:
   int in_width, in_height;
   int out_width, out_height;
@@ -34,4 +53,8 @@ private:
   int cnt = 0;
   std::unique_ptr<PubMaster> pm;
   std::vector<capnp::byte> msg_cache;
+
+  std::mutex stats_lock;
+  VideoEncoderStats stats;
+  std::map<uint32_t, double> frames_in_flight;  // frame id -> when it was given to the encoder
 };
@@ -24,8 +24,59 @@ extern "C" {
 
 const int env_debug_encoder = (getenv("DEBUG_ENCODER") != NULL) ? atoi(getenv("DEBUG_ENCODER")) : 0;
 
-FfmpegEncoder::FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height)
-    : VideoEncoder(encoder_info, in_width, in_height) {
+I420Frame FrameConverter::convert(VisionBuf *buf, uint32_t frame_id, int width, int height) {
+  Converted &c = cache[{width, height}];
+  if (c.frame && c.frame_id == frame_id) {
+    return c.frame;
+  }
+
+  // drop the cache's reference to the last frame first, so its buffer can be reused if no encoder has it
+  c.frame.reset();
+  std::shared_ptr<std::vector<uint8_t>> out;
+  for (auto &b : c.buffers) {
+    if (b.use_count() == 1) {
+      out = b;
+      break;
+    }
+  }
+  if (!out) {
+    out = c.buffers.emplace_back(std::make_shared<std::vector<uint8_t>>(width * height * 3 / 2));
+  }
+
+  uint8_t *out_y = out->data();
+  uint8_t *out_u = out_y + width * height;
+  uint8_t *out_v = out_u + (width / 2) * (height / 2);
+  if (width == buf->width && height == buf->height) {
+    libyuv::NV12ToI420(buf->y, buf->stride,
+                       buf->uv, buf->stride,
+                       out_y, width,
+                       out_u, width/2,
+                       out_v, width/2,
+                       width, height);
+  } else {
+    I420Frame full = convert(buf, frame_id, buf->width, buf->height);
+    const uint8_t *cy = full->data();
+    const uint8_t *cu = cy + buf->width * buf->height;
+    const uint8_t *cv = cu + (buf->width / 2) * (buf->height / 2);
+    libyuv::I420Scale(cy, buf->width,
+                      cu, buf->width/2,
+                      cv, buf->width/2,
+                      buf->width, buf->height,
+                      out_y, width,
+                      out_u, width/2,
+                      out_v, width/2,
+                      width, height,
+                      libyuv::kFilterNone);
+  }
+
+  c.frame_id = frame_id;
+  c.frame = out;
+  return c.frame;
+}
+
+FfmpegEncoder::FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height,
+                             std::shared_ptr<FrameConverter> converter)
+    : VideoEncoder(encoder_info, in_width, in_height), converter(converter) {
   frame = av_frame_alloc();
   assert(frame);
   frame->format = AV_PIX_FMT_YUV420P;
@@ -35,10 +86,11 @@ FfmpegEncoder::FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int
   frame->linesize[1] = out_width/2;
   frame->linesize[2] = out_width/2;
 
-  convert_buf.resize(in_width * in_height * 3 / 2);
-
-  if (in_width != out_width || in_height != out_height) {
-    downscale_buf.resize(out_width * out_height * 3 / 2);
+  if (!this->converter) {
+    this->converter = std::make_shared<FrameConverter>();
+  }
+  for (int i = 0; i < FFMPEG_BUF_IN_COUNT; i++) {
+    free_slots.push(i);
   }
 }
 
@@ -56,17 +108,24 @@ void FfmpegEncoder::encoder_open(const char* path) {
   this->codec_ctx->height = frame->height;
   this->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
   this->codec_ctx->time_base = (AVRational){ 1, encoder_info.fps };
+  this->codec_ctx->thread_count = FFMPEG_THREADS;
+  this->codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
   int err = avcodec_open2(this->codec_ctx, codec, NULL);
   assert(err >= 0);
 
   is_open = true;
   segment_num++;
   counter = 0;
+  failed = false;
+  encode_thread = std::thread(FfmpegEncoder::encode_handler, this);
 }
 
 void FfmpegEncoder::encoder_close() {
   if (!is_open) return;
 
+  // the thread encodes the queued frames and drains the encoder before exiting
+  to_encode.push({nullptr, {}});
+  encode_thread.join();
   avcodec_free_context(&codec_ctx);
   is_open = false;
 }
@@ -75,76 +134,89 @@ int FfmpegEncoder::encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra) {
   assert(buf->width == this->in_width);
   assert(buf->height == this->in_height);
 
-  uint8_t *cy = convert_buf.data();
-  uint8_t *cu = cy + in_width * in_height;
-  uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
-  libyuv::NV12ToI420(buf->y, buf->stride,
-                     buf->uv, buf->stride,
-                     cy, in_width,
-                     cu, in_width/2,
-                     cv, in_width/2,
-                     in_width, in_height);
-
-  if (downscale_buf.size() > 0) {
-    uint8_t *out_y = downscale_buf.data();
-    uint8_t *out_u = out_y + frame->width * frame->height;
-    uint8_t *out_v = out_u + (frame->width / 2) * (frame->height / 2);
-    libyuv::I420Scale(cy, in_width,
-                      cu, in_width/2,
-                      cv, in_width/2,
-                      in_width, in_height,
-                      out_y, frame->width,
-                      out_u, frame->width/2,
-                      out_v, frame->width/2,
-                      frame->width, frame->height,
-                      libyuv::kFilterNone);
-    frame->data[0] = out_y;
-    frame->data[1] = out_u;
-    frame->data[2] = out_v;
-  } else {
-    frame->data[0] = cy;
-    frame->data[1] = cu;
-    frame->data[2] = cv;
+  // wait for a free slot, this blocks when the encoder falls behind
+  free_slots.pop();
+  to_encode.push({converter->convert(buf, extra->frame_id, out_width, out_height), *extra});
+
+  // frames are encoded asynchronously, so an error shows up on the next frame
+  if (failed.exchange(false)) {
+    return -1;
   }
-  frame->pts = counter*50*1000; // 50ms per frame
+  return counter++;
+}
 
-  int ret = counter;
+void FfmpegEncoder::encode_handler(FfmpegEncoder *e) {
+  std::string thread_name = "enc-" + std::string(e->encoder_info.publish_name);
+  util::set_thread_name(thread_name.c_str());
+
+  // extras of the frames sent to the encoder, whose packets aren't out yet
+  std::deque<VisionIpcBufExtra> extras;
+  uint32_t idx = 0;
+  int64_t pts = 0;
+  while (true) {
+    auto [i420, extra] = e->to_encode.pop();
+    if (!i420) {
+      // flush the frames still in ffmpeg's threads
+      avcodec_send_frame(e->codec_ctx, NULL);
+      e->receive_packets(extras, idx);
+      break;
+    }
 
-  int err = avcodec_send_frame(this->codec_ctx, frame);
-  if (err < 0) {
-    LOGE("avcodec_send_frame error %d", err);
-    ret = -1;
+    AVFrame *frame = e->frame;
+    frame->data[0] = (uint8_t *)i420->data();
+    frame->data[1] = frame->data[0] + frame->width * frame->height;
+    frame->data[2] = frame->data[1] + (frame->width / 2) * (frame->height / 2);
+    frame->pts = pts++ * 50 * 1000; // 50ms per frame
+
+    // the frame isn't reference counted, so ffmpeg copies it and the buffer can be reused right away
+    int err = avcodec_send_frame(e->codec_ctx, frame);
+    i420.reset();
+    e->free_slots.push(0);
+    if (err < 0) {
+      LOGE("avcodec_send_frame error %d, frame_id: %d", err, extra.frame_id);
+      e->failed = true;
+      continue;
+    }
+    extras.push_back(extra);
+    e->receive_packets(extras, idx);
+  }
+
+  if (!extras.empty()) {
+    LOGE("%s: %zu frames were not encoded", e->encoder_info.publish_name, extras.size());
   }
+}
 
+void FfmpegEncoder::receive_packets(std::deque<VisionIpcBufExtra> &extras, uint32_t &idx) {
   AVPacket pkt;
   av_init_packet(&pkt);
   pkt.data = NULL;
   pkt.size = 0;
-  while (ret >= 0) {
-    err = avcodec_receive_packet(this->codec_ctx, &pkt);
-    if (err == AVERROR_EOF) {
-      break;
-    } else if (err == AVERROR(EAGAIN)) {
+  while (true) {
+    int err = avcodec_receive_packet(this->codec_ctx, &pkt);
+    if (err == AVERROR_EOF || err == AVERROR(EAGAIN)) {
       // Encoder might need a few frames on startup to get started. Keep going
-      ret = 0;
       break;
     } else if (err < 0) {
       LOGE("avcodec_receive_packet error %d", err);
-      ret = -1;
+      failed = true;
       break;
     }
 
+    // FFVHUFF is intra only, packets come out in the order the frames went in
+    assert(!extras.empty());
+    VisionIpcBufExtra extra = extras.front();
+    extras.pop_front();
+
     if (env_debug_encoder) {
-      printf("%20s got %8d bytes flags %8x idx %4d id %8d\n", encoder_info.publish_name, pkt.size, pkt.flags, counter, extra->frame_id);
+      printf("%20s got %8d bytes flags %8x idx %4d id %8d\n", encoder_info.publish_name, pkt.size, pkt.flags, idx, extra.frame_id);
     }
 
-    publisher_publish(this, segment_num, counter, *extra,
+    publisher_publish(this, segment_num, idx, extra,
       (pkt.flags & AV_PKT_FLAG_KEY) ? V4L2_BUF_FLAG_KEYFRAME : 0,
       kj::arrayPtr<capnp::byte>(pkt.data, (size_t)0), // TODO: get the header
       kj::arrayPtr<capnp::byte>(pkt.data, pkt.size));
 
-    counter++;
+    idx++;
+    av_packet_unref(&pkt);
   }
-  av_packet_unref(&pkt);
-  return ret;
 }
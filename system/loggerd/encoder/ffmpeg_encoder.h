@@ -1,8 +1,14 @@
 #pragma once
 
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 extern "C" {
@@ -14,21 +20,50 @@ extern "C" {
 #include "system/loggerd/encoder/encoder.h"
 #include "system/loggerd/loggerd.h"
 
+#define FFMPEG_BUF_IN_COUNT 4  // converted frames waiting to be encoded
+#define FFMPEG_THREADS 4       // ffmpeg's own frame/slice threads per encoder
+
+typedef std::shared_ptr<const std::vector<uint8_t>> I420Frame;
+
+// Converts the NV12 frames of one camera to I420 for all of its software encoders. Each size is
+// converted once per frame and shared, smaller sizes are scaled from the full size I420 frame.
+class FrameConverter {
+public:
+  I420Frame convert(VisionBuf *buf, uint32_t frame_id, int width, int height);
+
+private:
+  struct Converted {
+    uint32_t frame_id = 0;
+    I420Frame frame;
+    std::vector<std::shared_ptr<std::vector<uint8_t>>> buffers;  // reused once no encoder holds them
+  };
+  std::map<std::pair<int, int>, Converted> cache;
+};
+
+// Software encoder for PC. encode_frame() gets the frame in I420 from the camera's converter and queues
+// it, the frames are encoded and published on the encoder's own thread, so the encoders of a camera run in parallel.
 class FfmpegEncoder : public VideoEncoder {
 public:
-  FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height);
+  FfmpegEncoder(const EncoderInfo &encoder_info, int in_width, int in_height,
+                std::shared_ptr<FrameConverter> converter = nullptr);
   ~FfmpegEncoder();
   int encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra);
   void encoder_open(const char* path);
   void encoder_close();
 
 private:
+  static void encode_handler(FfmpegEncoder *e);
+  void receive_packets(std::deque<VisionIpcBufExtra> &extras, uint32_t &idx);
+
   int segment_num = -1;
   int counter = 0;
   bool is_open = false;
+  std::atomic<bool> failed = false;  // set by the encode thread, reported by the next encode_frame()
 
   AVCodecContext *codec_ctx;
   AVFrame *frame = NULL;
-  std::vector<uint8_t> convert_buf;
-  std::vector<uint8_t> downscale_buf;
+  std::shared_ptr<FrameConverter> converter;
+  SafeQueue<unsigned int> free_slots;  // bounds the frames queued for encoding
+  SafeQueue<std::pair<I420Frame, VisionIpcBufExtra>> to_encode;  // a null frame flushes and stops the thread
+  std::thread encode_thread;
 };
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cassert>
+#include <mutex>
 
 #include "system/loggerd/loggerd.h"
 
@@ -20,6 +22,10 @@ struct EncoderdState {
   std::atomic<uint32_t> start_frame_id = 0;
   bool camera_ready[WideRoadCam + 1] = {};
   bool camera_synced[WideRoadCam + 1] = {};
+
+  // encoders of all cameras, for the stats
+  std::mutex encoders_lock;
+  std::vector<VideoEncoder *> encoders;
 };
 
 // Handle initial encoder syncing by waiting for all encoders to reach the same frame id
@@ -48,6 +54,10 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
   util::set_thread_name(cam_info.thread_name);
 
   std::vector<std::unique_ptr<Encoder>> encoders;
+#ifndef QCOM2
+  // the software encoders of a camera share the conversion of each frame
+  auto converter = std::make_shared<FrameConverter>();
+#endif
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   int cur_seg = 0;
@@ -64,9 +74,16 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
       assert(buf_info.width > 0 && buf_info.height > 0);
 
       for (const auto &encoder_info : cam_info.encoder_infos) {
+#ifdef QCOM2
         auto &e = encoders.emplace_back(new Encoder(encoder_info, buf_info.width, buf_info.height));
+#else
+        auto &e = encoders.emplace_back(new Encoder(encoder_info, buf_info.width, buf_info.height, converter));
+#endif
         e->encoder_open(nullptr);
       }
+
+      std::lock_guard lk(s->encoders_lock);
+      for (auto &e : encoders) s->encoders.push_back(e.get());
     }
 
     bool lagging = false;
@@ -81,6 +98,7 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
           LOGE("encoder %s lag  buffer id: %" PRIu64 " extra id: %d", cam_info.thread_name, buf->get_frame_id(), extra.frame_id);
           lagging = true;
         }
+        for (auto &e : encoders) e->record_frame_lagged();
         continue;
       }
       lagging = false;
@@ -102,6 +120,7 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
 
       // encode a frame
       for (int i = 0; i < encoders.size(); ++i) {
+        encoders[i]->record_frame_in(extra.frame_id);
         int out_id = encoders[i]->encode_frame(buf, &extra);
 
         if (out_id == -1) {
@@ -110,10 +129,51 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
       }
     }
   }
+
+  std::lock_guard lk(s->encoders_lock);
+  for (auto &e : encoders) {
+    s->encoders.erase(std::find(s->encoders.begin(), s->encoders.end(), e.get()));
+  }
+}
+
+void publish_encoder_stats(EncoderdState *s, PubMaster *pm, double seconds, bool log_summary) {
+  MessageBuilder msg;
+  std::lock_guard lk(s->encoders_lock);
+  auto lencoders = msg.initEvent().initEncoderStats().initEncoders(s->encoders.size());
+  for (int i = 0; i < s->encoders.size(); ++i) {
+    VideoEncoderStats st = s->encoders[i]->take_stats();
+    double latency_avg = st.frames_out ? st.latency_ms_total / st.frames_out : 0;
+    double encode_avg = st.frames_out ? st.encode_ms_total / st.frames_out : 0;
+    double bitrate = st.bytes_out * 8 / seconds;
+
+    auto e = lencoders[i];
+    e.setName(s->encoders[i]->publish_name());
+    e.setFramesIn(st.frames_in);
+    e.setFramesOut(st.frames_out);
+    e.setFramesDropped(st.frames_dropped);
+    e.setFramesLagged(st.frames_lagged);
+    e.setQueueDepthMax(st.queue_depth_max);
+    e.setBitrate(bitrate);
+    e.setLatencyMillisAvg(latency_avg);
+    e.setLatencyMillisMax(st.latency_ms_max);
+    e.setEncodeMillisAvg(encode_avg);
+    e.setEncodeMillisMax(st.encode_ms_max);
+    e.setEncodeMillisHistogram(kj::ArrayPtr<const uint32_t>(st.encode_ms_histogram.data(), st.encode_ms_histogram.size()));
+
+    if (st.frames_dropped > 0 || st.frames_lagged > 0) {
+      LOGW("encoder %s: %u frames dropped, %u lagged", s->encoders[i]->publish_name(), st.frames_dropped, st.frames_lagged);
+    }
+    if (log_summary) {
+      LOGD("encoder %s: %u in %u out, %.2f Mbit/s, latency %.1f ms (max %.1f), encode %.1f ms (max %.1f), queue max %u",
+           s->encoders[i]->publish_name(), st.frames_in, st.frames_out, bitrate / 1e6,
+           latency_avg, st.latency_ms_max, encode_avg, st.encode_ms_max, st.queue_depth_max);
+    }
+  }
+  if (pm) pm->send("encoderStats", msg);
 }
 
 template <size_t N>
-void encoderd_thread(const LogCameraInfo (&cameras)[N]) {
+void encoderd_thread(const LogCameraInfo (&cameras)[N], bool publish_stats) {
   EncoderdState s;
 
   std::set<VisionStreamType> streams;
@@ -135,6 +195,16 @@ void encoderd_thread(const LogCameraInfo (&cameras)[N]) {
       encoder_threads.push_back(std::thread(encoder_thread, &s, *it));
     }
 
+    // only one encoderd can publish the stats, the livestream one just logs them
+    std::unique_ptr<PubMaster> pm(publish_stats ? new PubMaster({"encoderStats"}) : nullptr);
+    double last_ms = millis_since_boot();
+    for (int n = 1; !do_exit; ++n) {
+      util::sleep_for(1000);
+      double now = millis_since_boot();
+      publish_encoder_stats(&s, pm.get(), (now - last_ms) / 1000., n % 10 == 0);
+      last_ms = now;
+    }
+
     for (auto &t : encoder_threads) t.join();
   }
 }
@@ -150,12 +220,12 @@ int main(int argc, char* argv[]) {
   if (argc > 1) {
     std::string arg1(argv[1]);
     if (arg1 == "--stream") {
-      encoderd_thread(stream_cameras_logged);
+      encoderd_thread(stream_cameras_logged, false);
     } else {
       LOGE("Argument '%s' is not supported", arg1.c_str());
     }
   } else {
-    encoderd_thread(cameras_logged);
+    encoderd_thread(cameras_logged, true);
   }
   return 0;
 }
@@ -1,20 +1,285 @@
 #include "system/loggerd/logger.h"
 
+#include <algorithm>
 #include <fstream>
+#include <future>
 #include <map>
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <random>
 
+#include <bzlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
 #include "common/params.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/version.h"
 
+// ***** bz2 log file *****
+Bz2File::Bz2File(const std::string &file_path, uint64_t interval, size_t preallocate)
+    : preallocated(preallocate), frame_interval(interval) {
+  file = util::safe_fopen(file_path.c_str(), "wb");
+  assert(file != nullptr);
+  logger_preallocate(fileno(file), preallocated);
+  start(file_path);
+  compress_thread = std::thread(&Bz2File::compressThread, this);
+}
+
+void Bz2File::start(const std::string &file_path) {
+  path = file_path;
+  start_time = nanos_since_boot();
+  next_frame = start_time + frame_interval;
+}
+
+Bz2File::~Bz2File() {
+  close();
+}
+
+void Bz2File::close() {
+  if (!compress_thread.joinable()) return;
+
+  flushFrame();
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_one();
+  compress_thread.join();
+
+  if (preallocated > 0) {
+    util::safe_fflush(file);
+    if (ftruncate(fileno(file), offset) != 0) {
+      LOGE("%s: failed to release preallocated space: %s", path.c_str(), strerror(errno));
+    }
+  }
+  int err = fclose(file);
+  assert(err == 0);
+  file = nullptr;
+
+  LOGD("%s: %.1f KB -> %.1f KB, max %zu frames queued, write %.1f ms total %.1f ms max, compress %.1f ms total",
+       path.c_str(), stats_.bytes_in / 1024.0, stats_.bytes_out / 1024.0, stats_.max_queued,
+       stats_.total_write_ms, stats_.max_write_ms, stats_.total_compress_ms);
+}
+
+void Bz2File::write(void* data, size_t size) {
+  uint64_t now = nanos_since_boot();
+  if (now >= next_frame || frame.size() >= MAX_FRAME_SIZE) {
+    flushFrame();
+    next_frame = start_time + ((now - start_time) / frame_interval + 1) * frame_interval;
+  }
+  frame.append((const char *)data, size);
+}
+
+void Bz2File::flushFrame() {
+  if (frame.empty()) return;
+
+  size_t queued;
+  {
+    std::lock_guard lk(lock);
+    stats_.bytes_in += frame.size();
+    queue.push_back(std::move(frame));
+    queued = queue.size();
+    stats_.max_queued = std::max(stats_.max_queued, queued);
+
+    // swap in a buffer that already has room for a frame
+    frame.clear();
+    if (!free_frames.empty()) {
+      frame = std::move(free_frames.back());
+      free_frames.pop_back();
+    }
+  }
+  cv.notify_one();
+
+  if (queued > 10) {
+    LOGW("%s: compression is falling behind, %zu frames queued", path.c_str(), queued);
+  }
+}
+
+LogWriterStats Bz2File::stats() {
+  std::lock_guard lk(lock);
+  return stats_;
+}
+
+void Bz2File::compressThread() {
+  std::vector<char> out;
+  while (true) {
+    std::unique_lock lk(lock);
+    cv.wait(lk, [this] { return !queue.empty() || exit; });
+    if (queue.empty()) break;
+    std::string in = std::move(queue.front());
+    queue.pop_front();
+    lk.unlock();
+
+    double t1 = millis_since_boot();
+    // worst case bz2 output size is 1% larger than the input plus 600 bytes
+    unsigned int out_size = in.size() + in.size() / 100 + 600;
+    out.resize(out_size);
+    int ret = BZ2_bzBuffToBuffCompress(out.data(), &out_size, in.data(), in.size(), 9, 0, 30);
+    assert(ret == BZ_OK);
+
+    // flush every frame, so a complete frame is never left in the stdio buffer
+    double t2 = millis_since_boot();
+    size_t written = util::safe_fwrite(out.data(), 1, out_size, file);
+    assert(written == out_size);
+    util::safe_fflush(file);
+    double t3 = millis_since_boot();
+
+    lk.lock();
+    offset += out_size;
+    stats_.bytes_out += out_size;
+    stats_.total_compress_ms += t2 - t1;
+    stats_.total_write_ms += t3 - t2;
+    stats_.max_write_ms = std::max(stats_.max_write_ms, t3 - t2);
+    in.clear();
+    if (free_frames.size() < 2) free_frames.push_back(std::move(in));
+  }
+}
+
+// ***** log segment *****
+// removes the files of a segment, and the segment directory
+static void remove_segment_dir(const std::string &path) {
+  if (DIR *d = opendir(path.c_str())) {
+    while (struct dirent *de = readdir(d)) {
+      if (de->d_type != DT_DIR) {
+        std::remove((path + "/" + de->d_name).c_str());
+      }
+    }
+    closedir(d);
+  }
+  rmdir(path.c_str());
+}
+
+LoggerSegment::LoggerSegment(const std::string &segment_path, size_t last_rlog_size, size_t last_qlog_size)
+    : path(segment_path), lock_file(segment_path + "/rlog.lock") {
+  bool ret = util::create_directories(path, 0775);
+  assert(ret == true);
+  std::ofstream{lock_file};
+
+  rlog.reset(new Bz2File(path + "/rlog.bz2", Bz2File::LOG_FRAME_INTERVAL, logger_expected_size(last_rlog_size)));
+  qlog.reset(new Bz2File(path + "/qlog.bz2", Bz2File::LOG_FRAME_INTERVAL, logger_expected_size(last_qlog_size)));
+}
+
+void LoggerSegment::start(const std::string &segment_path) {
+  // the files stay open, so this is a single rename
+  int ret = rename(path.c_str(), segment_path.c_str());
+  assert(ret == 0);
+  path = segment_path;
+  lock_file = path + "/rlog.lock";
+  rlog->start(path + "/rlog.bz2");
+  qlog->start(path + "/qlog.bz2");
+}
+
+void LoggerSegment::close() {
+  rlog->close();
+  qlog->close();
+  std::remove(lock_file.c_str());
+}
+
+void LoggerSegment::remove() {
+  close();
+  remove_segment_dir(path);
+}
+
+void LoggerSegment::write(uint8_t* data, size_t size, bool in_qlog) {
+  rlog->write(data, size);
+  if (in_qlog) qlog->write(data, size);
+}
+
+// ***** background worker *****
+LoggerWorker::LoggerWorker(std::function<void()> periodic, std::chrono::milliseconds interval)
+    : periodic_job(std::move(periodic)), period(interval) {
+  thread = std::thread(&LoggerWorker::run, this);
+}
+
+LoggerWorker::~LoggerWorker() {
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_one();
+  thread.join();
+}
+
+void LoggerWorker::push(std::function<void()> job) {
+  {
+    std::lock_guard lk(lock);
+    jobs.push_back(std::move(job));
+  }
+  cv.notify_one();
+}
+
+void LoggerWorker::run() {
+  util::set_thread_name("loggerd_worker");
+  auto next_periodic = std::chrono::steady_clock::now() + period;
+  while (true) {
+    std::unique_lock lk(lock);
+    auto ready = [this] { return !jobs.empty() || exit; };
+    if (periodic_job) {
+      cv.wait_until(lk, next_periodic, ready);
+    } else {
+      cv.wait(lk, ready);
+    }
+    if (jobs.empty() && exit) break;
+    std::function<void()> job;
+    if (!jobs.empty()) {
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    lk.unlock();
+
+    if (job) job();
+    if (periodic_job && std::chrono::steady_clock::now() >= next_periodic) {
+      periodic_job();
+      next_periodic = std::chrono::steady_clock::now() + period;
+    }
+  }
+}
+
 // ***** log metadata *****
-kj::Array<capnp::word> logger_build_init_data() {
-  uint64_t wall_time = nanos_since_epoch();
+LoggerInitData::LoggerInitData() : params_path(util::getenv("PARAMS_COPY_PATH", "")), wall_time(nanos_since_epoch()) {
+  // gather the slow parts at the same time
+  auto kernel = std::async(std::launch::async, [this]() {
+    std::ifstream cmdline_stream("/proc/cmdline");
+    std::string buf;
+    while (cmdline_stream >> buf) {
+      kernel_args.push_back(buf);
+    }
+    kernel_version = util::read_file("/proc/version");
+    os_version = util::read_file("/VERSION");
+  });
+  auto df = std::async(std::launch::async, []() { return util::check_output("df -h"); });  // usage for all filesystems
+  auto hw_logs = std::async(std::launch::async, []() { return Hardware::get_init_logs(); });
+  refreshParams();
 
+  kernel.wait();
+  commands.push_back({"df -h", df.get()});
+  for (auto &[key, value] : hw_logs.get()) {
+    commands.push_back({key, value});
+  }
+}
+
+bool LoggerInitData::refreshParams() {
+  // writing a param renames a file into the params directory, which changes its mtime
+  Params params(params_path);
+  struct stat st = {};
+  stat(params.getParamPath().c_str(), &st);
+  if (params_read && st.st_mtim.tv_sec == params_mtime.tv_sec && st.st_mtim.tv_nsec == params_mtime.tv_nsec) {
+    return false;
+  }
+
+  params_mtime = st.st_mtim;
+  params_read = true;
+  params_map.clear();
+  for (auto &[key, value] : params.readAll()) {
+    params_map[key] = {value, !(params.getKeyType(key) & DONT_LOG)};
+  }
+  return true;
+}
+
+kj::Array<capnp::word> LoggerInitData::build() {
   MessageBuilder msg;
   auto init = msg.initEvent().initInitData();
 
@@ -24,71 +289,53 @@ kj::Array<capnp::word> logger_build_init_data() {
   init.setDeviceType(Hardware::get_device_type());
 
   // log kernel args
-  std::ifstream cmdline_stream("/proc/cmdline");
-  std::vector<std::string> kernel_args;
-  std::string buf;
-  while (cmdline_stream >> buf) {
-    kernel_args.push_back(buf);
-  }
-
   auto lkernel_args = init.initKernelArgs(kernel_args.size());
-  for (int i=0; i<kernel_args.size(); i++) {
+  for (int i = 0; i < kernel_args.size(); i++) {
     lkernel_args.set(i, kernel_args[i]);
   }
 
-  init.setKernelVersion(util::read_file("/proc/version"));
-  init.setOsVersion(util::read_file("/VERSION"));
+  init.setKernelVersion(kernel_version);
+  init.setOsVersion(os_version);
 
   // log params
-  auto params = Params(util::getenv("PARAMS_COPY_PATH", ""));
-  std::map<std::string, std::string> params_map = params.readAll();
-
-  init.setGitCommit(params_map["GitCommit"]);
-  init.setGitCommitDate(params_map["GitCommitDate"]);
-  init.setGitBranch(params_map["GitBranch"]);
-  init.setGitRemote(params_map["GitRemote"]);
+  auto param = [this](const char *key) {
+    auto it = params_map.find(key);
+    return it != params_map.end() ? it->second.first : "";
+  };
+  init.setGitCommit(param("GitCommit"));
+  init.setGitCommitDate(param("GitCommitDate"));
+  init.setGitBranch(param("GitBranch"));
+  init.setGitRemote(param("GitRemote"));
   init.setPassive(false);
-  init.setDongleId(params_map["DongleId"]);
+  init.setDongleId(param("DongleId"));
 
   auto lparams = init.initParams().initEntries(params_map.size());
   int j = 0;
-  for (auto& [key, value] : params_map) {
+  for (auto& [key, entry] : params_map) {
     auto lentry = lparams[j];
     lentry.setKey(key);
-    if ( !(params.getKeyType(key) & DONT_LOG) ) {
+    auto &[value, log_value] = entry;
+    if (log_value) {
       lentry.setValue(capnp::Data::Reader((const kj::byte*)value.data(), value.size()));
     }
     j++;
   }
 
   // log commands
-  std::vector<std::string> log_commands = {
-    "df -h",  // usage for all filesystems
-  };
-
-  auto hw_logs = Hardware::get_init_logs();
-
-  auto commands = init.initCommands().initEntries(log_commands.size() + hw_logs.size());
-  for (int i = 0; i < log_commands.size(); i++) {
-    auto lentry = commands[i];
-
-    lentry.setKey(log_commands[i]);
-
-    const std::string result = util::check_output(log_commands[i]);
-    lentry.setValue(capnp::Data::Reader((const kj::byte*)result.data(), result.size()));
-  }
-
-  int i = log_commands.size();
-  for (auto &[key, value] : hw_logs) {
-    auto lentry = commands[i];
-    lentry.setKey(key);
-    lentry.setValue(capnp::Data::Reader((const kj::byte*)value.data(), value.size()));
-    i++;
+  auto lcommands = init.initCommands().initEntries(commands.size());
+  for (int i = 0; i < commands.size(); i++) {
+    auto lentry = lcommands[i];
+    lentry.setKey(commands[i].first);
+    lentry.setValue(capnp::Data::Reader((const kj::byte*)commands[i].second.data(), commands[i].second.size()));
   }
 
   return capnp::messageToFlatArray(msg);
 }
 
+kj::Array<capnp::word> logger_build_init_data() {
+  return LoggerInitData().build();
+}
+
 std::string logger_get_identifier(std::string key) {
   // a log identifier is a 32 bit counter, plus a 10 character unique ID.
   // e.g. 000001a3--c20ba54385
@@ -121,43 +368,81 @@ static void log_sentinel(LoggerState *log, SentinelType type, int eixt_signal =
   log->write(msg.toBytes(), true);
 }
 
-LoggerState::LoggerState(const std::string &log_root) {
-  route_name = logger_get_identifier("RouteCount");
-  route_path = log_root + "/" + route_name;
-  init_data = logger_build_init_data();
+LoggerState::LoggerState(const std::string &root)
+    : log_root(root), route_name(logger_get_identifier("RouteCount")), route_path(log_root + "/" + route_name),
+      init_data(std::make_shared<kj::Array<capnp::word>>(init_info.build())),
+      worker([this]() { refreshInitData(); }) {
+
+  // remove the segments a previous run prepared and never started
+  worker.push([this]() {
+    if (DIR *d = opendir(log_root.c_str())) {
+      while (struct dirent *de = readdir(d)) {
+        const std::string name = de->d_name;
+        if (de->d_type == DT_DIR && name[0] == '.' && name.find("--") != std::string::npos) {
+          remove_segment_dir(log_root + "/" + name);
+        }
+      }
+      closedir(d);
+    }
+  });
 }
 
 LoggerState::~LoggerState() {
-  if (rlog) {
+  if (seg) {
     log_sentinel(this, SentinelType::END_OF_ROUTE, exit_signal);
-    std::remove(lock_file.c_str());
+    seg->close();
+  }
+  if (next_seg.valid()) {
+    next_seg.get()->remove();
+  }
+}
+
+std::string LoggerState::partPath(int n, bool hidden) const {
+  return log_root + (hidden ? "/." : "/") + route_name + "--" + std::to_string(n);
+}
+
+void LoggerState::refreshInitData() {
+  // only a stat() unless the params changed
+  if (init_info.refreshParams()) {
+    std::atomic_store(&init_data, std::make_shared<kj::Array<capnp::word>>(init_info.build()));
   }
 }
 
 bool LoggerState::next() {
-  if (rlog) {
+  if (seg) {
     log_sentinel(this, SentinelType::END_OF_SEGMENT);
-    std::remove(lock_file.c_str());
+    // closing waits for the last frames to be compressed, don't hold up logging for it
+    LoggerSegment *prev = seg.release();
+    worker.push([this, prev]() {
+      prev->close();
+      last_rlog_size = prev->rlog->stats().bytes_out;
+      last_qlog_size = prev->qlog->stats().bytes_out;
+      delete prev;
+    });
   }
 
-  segment_path = route_path + "--" + std::to_string(++part);
-  bool ret = util::create_directories(segment_path, 0775);
-  assert(ret == true);
-
-  const std::string rlog_path = segment_path + "/rlog";
-  lock_file = rlog_path + ".lock";
-  std::ofstream{lock_file};
-
-  rlog.reset(new RawFile(rlog_path));
-  qlog.reset(new RawFile(segment_path + "/qlog"));
-
-  // log init data & sentinel type.
-  write(init_data.asBytes(), true);
+  // only the first segment is created here, the others were created on the worker
+  ++part;
+  if (next_seg.valid()) {
+    seg = next_seg.get();
+    seg->start(partPath(part));
+  } else {
+    seg = std::make_unique<LoggerSegment>(partPath(part), last_rlog_size, last_qlog_size);
+  }
+  // log init data
+  auto init = std::atomic_load(&init_data);
+  seg->write(init->asBytes().begin(), init->asBytes().size(), true);
   log_sentinel(this, part > 0 ? SentinelType::START_OF_SEGMENT : SentinelType::START_OF_ROUTE);
+
+  // runs after the previous segment is closed, so it's preallocated from its sizes
+  auto prepared = std::make_shared<std::promise<std::unique_ptr<LoggerSegment>>>();
+  next_seg = prepared->get_future();
+  worker.push([this, prepared, path = partPath(part + 1, true)]() {
+    prepared->set_value(std::make_unique<LoggerSegment>(path, last_rlog_size, last_qlog_size));
+  });
   return true;
 }
 
 void LoggerState::write(uint8_t* data, size_t size, bool in_qlog) {
-  rlog->write(data, size);
-  if (in_qlog) qlog->write(data, size);
+  seg->write(data, size, in_qlog);
 }
@@ -1,13 +1,43 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
 
 #include "cereal/messaging/messaging.h"
 #include "common/util.h"
 #include "system/hardware/hw.h"
 
+// Segment files are preallocated to the size of the previous file of the same kind plus some
+// margin, so the filesystem allocates them in one go instead of growing them for every append.
+inline size_t logger_expected_size(size_t last_size) {
+  return std::min(last_size + last_size / 8, (size_t)512 * 1024 * 1024);
+}
+
+// The file size is left unchanged, whatever isn't used is released by ftruncate on close.
+// Best effort, not every filesystem supports it.
+inline void logger_preallocate(int fd, size_t size) {
+#ifdef __linux__
+  if (size > 0) {
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+  }
+#endif
+}
+
 class RawFile {
  public:
   RawFile(const std::string &path) {
@@ -29,8 +59,111 @@ class RawFile {
   FILE* file = nullptr;
 };
 
+struct LogWriterStats {
+  uint64_t bytes_in = 0, bytes_out = 0;
+  size_t max_queued = 0;  // most frames waiting to be compressed at once
+  double max_write_ms = 0, total_write_ms = 0, total_compress_ms = 0;
+};
+
+// Writes a bz2 compressed log. The log is cut into frames at fixed offsets from the
+// start of the file, each frame is compressed into its own bz2 stream on a separate
+// thread. The streams concatenate to a regular bz2 file, and a reader can start at any frame.
+// Only the writer thread touches the disk, so a slow flash never blocks write().
+class Bz2File {
+ public:
+  Bz2File(const std::string &path, uint64_t frame_interval = LOG_FRAME_INTERVAL, size_t preallocate = 0);
+  ~Bz2File();
+  // the file was moved to path, the frames are timed from here
+  void start(const std::string &path);
+  void write(void* data, size_t size);
+  inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  void flushFrame();
+  // flushes the last frame and waits for everything to be written
+  void close();
+  LogWriterStats stats();
+
+  static constexpr uint64_t LOG_FRAME_INTERVAL = 1000000000ULL;  // ns
+  static constexpr size_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+ private:
+  void compressThread();
+
+  std::string path;
+  FILE* file = nullptr;
+  size_t preallocated;
+  uint64_t start_time, frame_interval, next_frame;
+  std::string frame;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::string> queue;  // frames to compress
+  uint64_t offset = 0;
+  std::vector<std::string> free_frames;  // compressed frames, kept to reuse their allocation
+  LogWriterStats stats_;
+  bool exit = false;
+  std::thread compress_thread;
+};
+
 typedef cereal::Sentinel::SentinelType SentinelType;
 
+// The logs of one segment. The rlog.lock file marks the segment as in use.
+class LoggerSegment {
+public:
+  LoggerSegment(const std::string &segment_path, size_t last_rlog_size, size_t last_qlog_size);
+  // moves a segment created ahead of time to segment_path, it starts from here
+  void start(const std::string &segment_path);
+  void write(uint8_t* data, size_t size, bool in_qlog);
+  // finishes the logs, then removes the lock file
+  void close();
+  // closes the segment and deletes it, for one that was never started
+  void remove();
+
+  std::string path;
+  std::unique_ptr<Bz2File> rlog, qlog;
+
+private:
+  std::string lock_file;
+};
+
+// Runs jobs one after another on a background thread. The destructor runs the remaining jobs.
+// The periodic job runs in between, once per period.
+class LoggerWorker {
+public:
+  LoggerWorker(std::function<void()> periodic_job = nullptr, std::chrono::milliseconds period = std::chrono::seconds(1));
+  ~LoggerWorker();
+  void push(std::function<void()> job);
+
+private:
+  void run();
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> jobs;
+  std::function<void()> periodic_job;
+  std::chrono::milliseconds period;
+  bool exit = false;
+  std::thread thread;
+};
+
+// The initData event. Gathering it runs commands and reads every param, so it's
+// collected once, and only the params are read again, when any of them changed.
+class LoggerInitData {
+public:
+  LoggerInitData();
+  // returns true if the params changed since they were last read
+  bool refreshParams();
+  kj::Array<capnp::word> build();
+
+private:
+  std::string params_path;
+  uint64_t wall_time;  // when logging started, the same in every segment
+  std::vector<std::string> kernel_args;
+  std::string kernel_version, os_version;
+  std::vector<std::pair<std::string, std::string>> commands;
+  std::map<std::string, std::pair<std::string, bool>> params_map;  // value, and if the value may be logged
+  struct timespec params_mtime = {};
+  bool params_read = false;
+};
 
 class LoggerState {
 public:
@@ -39,16 +172,30 @@ public:
   bool next();
   void write(uint8_t* data, size_t size, bool in_qlog);
   inline int segment() const { return part; }
-  inline const std::string& segmentPath() const { return segment_path; }
+  inline const std::string& segmentPath() const { return seg->path; }
   inline const std::string& routeName() const { return route_name; }
   inline void write(kj::ArrayPtr<kj::byte> bytes, bool in_qlog) { write(bytes.begin(), bytes.size(), in_qlog); }
   inline void setExitSignal(int signal) { exit_signal = signal; }
+  // Runs the job on the thread that prepares and closes segments, for work that
+  // shouldn't stall logging, like closing the video files of the last segment.
+  inline void runAsync(std::function<void()> job) { worker.push(std::move(job)); }
 
 protected:
+  // segments are created in a hidden directory of the log root, until they start
+  std::string partPath(int n, bool hidden = false) const;
+  void refreshInitData();
+
   int part = -1, exit_signal = 0;
-  std::string route_path, route_name, segment_path, lock_file;
-  kj::Array<capnp::word> init_data;
-  std::unique_ptr<RawFile> rlog, qlog;
+  std::string log_root, route_name, route_path;
+  LoggerInitData init_info;  // after the route name, its RouteCount is logged
+  // rebuilt on the worker when the params change, a rotation takes whichever is current
+  std::shared_ptr<kj::Array<capnp::word>> init_data;
+  std::unique_ptr<LoggerSegment> seg;
+  // The next segment is created and its files are opened on the worker while this one is logged,
+  // the rotation only renames it. A hidden segment left behind by a crash is removed on startup.
+  std::future<std::unique_ptr<LoggerSegment>> next_seg;
+  std::atomic<size_t> last_rlog_size = 0, last_qlog_size = 0;  // set on the worker when a segment is closed
+  LoggerWorker worker;  // last, its jobs use the members above
 };
 
 kj::Array<capnp::word> logger_build_init_data();
@@ -1,5 +1,6 @@
 #include <sys/xattr.h>
 
+#include <deque>
 #include <map>
 #include <memory>
 #include <string>
@@ -19,6 +20,10 @@ struct LoggerdState {
   std::atomic<int> ready_to_rotate;  // count of encoders ready to rotate
   int max_waiting = 0;
   double last_rotate_tms = 0.;      // last rotate time in ms
+
+  // reused for every EncodeIndex event, the scratch segment must start out zeroed
+  capnp::word idx_scratch[128] = {};
+  kj::Array<capnp::word> idx_buf = kj::heapArray<capnp::word>(128);
 };
 
 void logger_rotate(LoggerdState *s) {
@@ -57,18 +62,20 @@ struct RemoteEncoder {
   std::unique_ptr<VideoWriter> writer;
   int encoderd_segment_offset;
   int current_segment = -1;
-  std::vector<Message *> q;
+  std::deque<kj::Array<capnp::word>> q;  // packets of the next segment, received before rotating
+  AlignedBuffer buf;
   int dropped_frames = 0;
+  size_t last_file_size = 0;  // to preallocate the next file
   bool recording = false;
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
 };
 
-int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct RemoteEncoder &re, const EncoderInfo &encoder_info) {
+int handle_encoder_msg(LoggerdState *s, kj::ArrayPtr<const capnp::word> msg, std::string &name, struct RemoteEncoder &re, const EncoderInfo &encoder_info) {
   int bytes_count = 0;
 
   // extract the message
-  capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)));
+  capnp::FlatArrayMessageReader cmsg(msg);
   auto event = cmsg.getRoot<cereal::Event>();
   auto edata = (event.*(encoder_info.get_encode_data_func))();
   auto idx = edata.getIdx();
@@ -88,17 +95,23 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     // if this is a new segment, we close any possible old segments, move to the new, and process any queued packets
     if (re.current_segment != s->logger.segment()) {
       if (re.recording) {
-        re.writer.reset();
+        if (re.writer) {
+          re.last_file_size = re.writer->bytesWritten();
+          // finishing the file can block on the disk, close it on the logger's worker
+          VideoWriter *writer = re.writer.release();
+          s->logger.runAsync([writer]() { delete writer; });
+        }
         re.recording = false;
       }
       re.current_segment = s->logger.segment();
       re.marked_ready_to_rotate = false;
       // we are in this segment now, process any queued messages before this one
       if (!re.q.empty()) {
-        for (auto &qmsg : re.q) {
+        auto q = std::move(re.q);
+        re.q.clear();
+        for (auto &qmsg : q) {
           bytes_count += handle_encoder_msg(s, qmsg, name, re, encoder_info);
         }
-        re.q.clear();
       }
     }
 
@@ -116,7 +129,8 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
           assert(encoder_info.filename != NULL);
           re.writer.reset(new VideoWriter(s->logger.segmentPath().c_str(),
             encoder_info.filename, idx.getType() != cereal::EncodeIndex::Type::FULL_H_E_V_C,
-            edata.getWidth(), edata.getHeight(), encoder_info.fps, idx.getType()));
+            edata.getWidth(), edata.getHeight(), encoder_info.fps, idx.getType(), logger_expected_size(re.last_file_size),
+            LOGGERD_FRAGMENTED_MP4));
           // write the header
           auto header = edata.getHeader();
           re.writer->write((uint8_t *)header.begin(), header.size(), idx.getTimestampEof()/1000, true, false);
@@ -125,7 +139,6 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
       } else {
         // this is a sad case when we aren't recording, but don't have an iframe
         // nothing we can do but drop the frame
-        delete msg;
         ++re.dropped_frames;
         return bytes_count;
       }
@@ -141,16 +154,17 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     }
 
     // put it in log stream as the idx packet
-    MessageBuilder bmsg;
+    MessageBuilder bmsg(kj::arrayPtr(s->idx_scratch, std::size(s->idx_scratch)));
     auto evt = bmsg.initEvent(event.getValid());
     evt.setLogMonoTime(event.getLogMonoTime());
     (evt.*(encoder_info.set_encode_idx_func))(idx);
-    auto new_msg = bmsg.toBytes();
-    s->logger.write((uint8_t *)new_msg.begin(), new_msg.size(), true);   // always in qlog?
-    bytes_count += new_msg.size();
-
-    // free the message, we used it
-    delete msg;
+    size_t size = bmsg.getSerializedSize();
+    if (s->idx_buf.size() * sizeof(capnp::word) < size) {
+      s->idx_buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+    }
+    bmsg.serializeToBuffer((unsigned char *)s->idx_buf.begin(), size);
+    s->logger.write((uint8_t *)s->idx_buf.begin(), size, true);   // always in qlog?
+    bytes_count += size;
   } else if (offset_segment_num > s->logger.segment()) {
     // encoderd packet has a newer segment, this means encoderd has rolled over
     if (!re.marked_ready_to_rotate) {
@@ -161,14 +175,15 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
         s->ready_to_rotate.load(), s->max_waiting, name.c_str());
     }
     // queue up all the new segment messages, they go in after the rotate
-    re.q.push_back(msg);
+    auto qmsg = kj::heapArray<capnp::word>(msg.size());
+    memcpy(qmsg.begin(), msg.begin(), msg.size() * sizeof(capnp::word));
+    re.q.push_back(std::move(qmsg));
   } else {
     LOGE("%s: encoderd packet has a older segment!!! idx.getSegmentNum():%d s->logger.segment():%d re.encoderd_segment_offset:%d",
       name.c_str(), idx.getSegmentNum(), s->logger.segment(), re.encoderd_segment_offset);
-    // free the message, it's useless. this should never happen
+    // drop the message, it's useless. this should never happen
     // actually, this can happen if you restart encoderd
     re.encoderd_segment_offset = -s->logger.segment();
-    delete msg;
   }
 
   return bytes_count;
@@ -256,13 +271,24 @@ void loggerd_thread() {
 
       // drain socket
       int count = 0;
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
+      while (!do_exit) {
         if (service.encoder) {
+          // copy the packet into a buffer that is reused, instead of a new allocation per packet
+          char *data;
+          size_t size;
+          if (!sock->receive_view(&data, &size)) break;
+          RemoteEncoder &re = remote_encoders[sock];
+          kj::ArrayPtr<const capnp::word> words = re.buf.align(data, size);
+          if (!sock->release_view()) continue;  // overwritten while copying
+
+          service.counter++;
           s.last_camera_seen_tms = millis_since_boot();
-          bytes_count += handle_encoder_msg(&s, msg, service.name, remote_encoders[sock], encoder_infos_dict[service.name]);
+          bytes_count += handle_encoder_msg(&s, words, service.name, re, encoder_infos_dict[service.name]);
         } else {
+          Message *msg = sock->receive(true);
+          if (!msg) break;
+
+          const bool in_qlog = service.freq != -1 && (service.counter++ % service.freq == 0);
           s.logger.write((uint8_t *)msg->getData(), msg->getSize(), in_qlog);
           bytes_count += msg->getSize();
           delete msg;
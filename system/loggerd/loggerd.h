@@ -26,6 +26,8 @@ const int QCAM_BITRATE = 256000;
   .init_encode_data_func = &cereal::Event::Builder::init##encode_type##Data
 
 const bool LOGGERD_TEST = getenv("LOGGERD_TEST");
+// write the camera streams as fragmented mp4 (fcamera.mp4, qcamera.mp4, ...), readable while being recorded
+const bool LOGGERD_FRAGMENTED_MP4 = getenv("LOGGERD_FRAGMENTED_MP4");
 const int SEGMENT_LENGTH = LOGGERD_TEST ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
 
 constexpr char PRESERVE_ATTR_NAME[] = "user.preserve";
@@ -1,17 +1,45 @@
+#include <bzlib.h>
+
+#include <fstream>
+
 #include "catch2/catch.hpp"
 #include "system/loggerd/logger.h"
 
 typedef cereal::Sentinel::SentinelType SentinelType;
 
+// decompresses all concatenated bz2 streams, returns the number of streams in num_streams
+std::string decompress_bz2(const std::string &in, int *num_streams = nullptr) {
+  std::string out;
+  char buf[64 * 1024];
+  bz_stream strm = {};
+  strm.next_in = (char *)in.data();
+  strm.avail_in = in.size();
+  int streams = 0;
+  while (strm.avail_in > 0) {
+    REQUIRE(BZ2_bzDecompressInit(&strm, 0, 0) == BZ_OK);
+    int ret = BZ_OK;
+    while (ret == BZ_OK) {
+      strm.next_out = buf;
+      strm.avail_out = sizeof(buf);
+      ret = BZ2_bzDecompress(&strm);
+      out.append(buf, sizeof(buf) - strm.avail_out);
+    }
+    REQUIRE(ret == BZ_STREAM_END);
+    BZ2_bzDecompressEnd(&strm);
+    streams++;
+  }
+  if (num_streams) *num_streams = streams;
+  return out;
+}
+
 void verify_segment(const std::string &route_path, int segment, int max_segment, int required_event_cnt) {
   const std::string segment_path = route_path + "--" + std::to_string(segment);
   SentinelType begin_sentinel = segment == 0 ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT;
   SentinelType end_sentinel = segment == max_segment - 1 ? SentinelType::END_OF_ROUTE : SentinelType::END_OF_SEGMENT;
 
   REQUIRE(!util::file_exists(segment_path + "/rlog.lock"));
-  for (const char *fn : {"/rlog", "/qlog"}) {
-    const std::string log_file = segment_path + fn;
-    std::string log = util::read_file(log_file);
+  for (const char *fn : {"/rlog.bz2", "/qlog.bz2"}) {
+    std::string log = decompress_bz2(util::read_file(segment_path + fn));
     REQUIRE(!log.empty());
     int event_cnt = 0, i = 0;
     kj::ArrayPtr<const capnp::word> words((capnp::word *)log.data(), log.size() / sizeof(capnp::word));
@@ -56,6 +84,10 @@ TEST_CASE("logger") {
   const int segment_cnt = 100;
   const std::string log_root = "/tmp/test_logger";
   system(("rm " + log_root + " -rf").c_str());
+  // a segment prepared by a run that crashed
+  const std::string stale_segment = log_root + "/.00000001--0123456789--1";
+  REQUIRE(util::create_directories(stale_segment, 0775));
+  std::ofstream{stale_segment + "/rlog.bz2"};
   std::string route_name;
   {
     LoggerState logger(log_root);
@@ -71,4 +103,47 @@ TEST_CASE("logger") {
   for (int i = 0; i < segment_cnt; ++i) {
     verify_segment(log_root + "/" + route_name, i, segment_cnt, 1);
   }
+  // the segment prepared for the next rotation is removed, and so is the stale one
+  REQUIRE(!util::file_exists(log_root + "/" + route_name + "--" + std::to_string(segment_cnt)));
+  REQUIRE(!util::file_exists(log_root + "/." + route_name + "--" + std::to_string(segment_cnt)));
+  REQUIRE(!util::file_exists(stale_segment));
+}
+
+TEST_CASE("Bz2File frames") {
+  const std::string path = "/tmp/test_bz2file.bz2";
+  std::string expected;
+  {
+    // every write starts a new frame
+    Bz2File file(path, 1);
+    for (int i = 0; i < 10; ++i) {
+      std::string data(1000 * (i + 1), 'a' + i);
+      file.write(data.data(), data.size());
+      expected += data;
+      usleep(1000);
+    }
+  }
+  int num_streams = 0;
+  REQUIRE(decompress_bz2(util::read_file(path), &num_streams) == expected);
+  REQUIRE(num_streams == 10);
+  std::remove(path.c_str());
+}
+
+TEST_CASE("LoggerWorker periodic job") {
+  std::atomic<int> periodic_cnt = 0, job_cnt = 0;
+  {
+    LoggerWorker worker([&]() { periodic_cnt++; }, std::chrono::milliseconds(10));
+    // runs while idle, and between jobs that keep the worker busy
+    std::this_thread::sleep_for(std::chrono::milliseconds(55));
+    REQUIRE(periodic_cnt >= 3);
+    int cnt = periodic_cnt;
+    for (int i = 0; i < 10; ++i) {
+      worker.push([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        job_cnt++;
+      });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    REQUIRE(periodic_cnt >= cnt + 3);
+  }
+  REQUIRE(job_cnt == 10);
 }
@@ -1,14 +1,25 @@
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
 #include <cassert>
+#include <sys/uio.h>
 
 #include "system/loggerd/video_writer.h"
+#include "system/loggerd/logger.h"
 #include "common/swaglog.h"
 #include "common/util.h"
 
-VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec)
-  : remuxing(remuxing) {
-  vid_path = util::string_format("%s/%s", path, filename);
-  lock_path = util::string_format("%s/%s.lock", path, filename);
+VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec,
+                         size_t preallocate, bool fragmented) {
+  bool raw = (codec == cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS);
+  // mp4 has no lossless codec, those stay in matroska, which is written in clusters anyway
+  this->fragmented = fragmented && !raw;
+  this->remuxing = remuxing || this->fragmented;
+
+  std::string name = filename;
+  if (this->fragmented) {
+    name = name.substr(0, name.rfind('.')) + ".mp4";
+  }
+  vid_path = util::string_format("%s/%s", path, name.c_str());
+  lock_path = util::string_format("%s/%s.lock", path, name.c_str());
 
   int lock_fd = HANDLE_EINTR(open(lock_path.c_str(), O_RDWR | O_CREAT, 0664));
   assert(lock_fd >= 0);
@@ -16,17 +27,23 @@ VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing,
 
   LOGD("encoder_open %s remuxing:%d", this->vid_path.c_str(), this->remuxing);
   if (this->remuxing) {
-    bool raw = (codec == cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS);
-    avformat_alloc_output_context2(&this->ofmt_ctx, NULL, raw ? "matroska" : NULL, this->vid_path.c_str());
+    avformat_alloc_output_context2(&this->ofmt_ctx, NULL, raw ? "matroska" : (this->fragmented ? "mp4" : NULL), this->vid_path.c_str());
     assert(this->ofmt_ctx);
 
     // set codec correctly. needed?
-    assert(codec != cereal::EncodeIndex::Type::FULL_H_E_V_C);
-    const AVCodec *avcodec = avcodec_find_encoder(raw ? AV_CODEC_ID_FFVHUFF : AV_CODEC_ID_H264);
-    assert(avcodec);
+    const AVCodec *avcodec = NULL;
+    if (codec != cereal::EncodeIndex::Type::FULL_H_E_V_C) {
+      avcodec = avcodec_find_encoder(raw ? AV_CODEC_ID_FFVHUFF : AV_CODEC_ID_H264);
+      assert(avcodec);
+    }
 
     this->codec_ctx = avcodec_alloc_context3(avcodec);
     assert(this->codec_ctx);
+    if (avcodec == NULL) {
+      // HEVC is only remuxed into mp4, the stream is copied and no encoder is needed
+      this->codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+      this->codec_ctx->codec_id = AV_CODEC_ID_HEVC;
+    }
     this->codec_ctx->width = width;
     this->codec_ctx->height = height;
     this->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
@@ -41,20 +58,63 @@ VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing,
     this->out_stream = avformat_new_stream(this->ofmt_ctx, raw ? avcodec : NULL);
     assert(this->out_stream);
 
+    if (this->fragmented) {
+      // an empty moov up front, then a moof for every keyframe
+      this->out_stream->avg_frame_rate = (AVRational){ fps, 1 };
+      av_dict_set(&this->muxer_opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
     int err = avio_open(&this->ofmt_ctx->pb, this->vid_path.c_str(), AVIO_FLAG_WRITE);
     assert(err >= 0);
 
   } else {
-    this->of = util::safe_fopen(this->vid_path.c_str(), "wb");
-    assert(this->of);
+    this->fd = HANDLE_EINTR(open(this->vid_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664));
+    assert(this->fd >= 0);
+    // ffmpeg owns the file when remuxing, only raw files are preallocated
+    this->preallocated = preallocate;
+    logger_preallocate(this->fd, this->preallocated);
   }
 }
 
-void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe) {
-  if (of && data) {
-    size_t written = util::safe_fwrite(data, 1, len, of);
-    if (written != len) {
+// Writes straight from the packet buffer without going through stdio. The header is small
+// and held back, so it goes out in the same writev as the first frame.
+void VideoWriter::writeRaw(uint8_t *data, int len) {
+  struct iovec iov[2];
+  int iovcnt = 0;
+  if (!pending_header.empty()) {
+    iov[iovcnt++] = {pending_header.data(), pending_header.size()};
+  }
+  iov[iovcnt++] = {data, (size_t)len};
+
+  while (iovcnt > 0) {
+    ssize_t written = HANDLE_EINTR(writev(fd, iov, iovcnt));
+    if (written < 0) {
       LOGE("failed to write file.errno=%d", errno);
+      break;
+    }
+    written_bytes += written;
+    // partial write, skip what made it to the file
+    struct iovec *v = iov;
+    while (iovcnt > 0 && written >= (ssize_t)v->iov_len) {
+      written -= v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      v->iov_base = (uint8_t *)v->iov_base + written;
+      v->iov_len -= written;
+      memmove(iov, v, iovcnt * sizeof(struct iovec));
+    }
+  }
+  pending_header.clear();
+}
+
+void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe) {
+  if (fd >= 0 && data) {
+    if (codecconfig) {
+      pending_header.insert(pending_header.end(), data, data + len);
+    } else {
+      writeRaw(data, len);
     }
   }
 
@@ -67,8 +127,9 @@ void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecc
       }
       int err = avcodec_parameters_from_context(out_stream->codecpar, codec_ctx);
       assert(err >= 0);
-      err = avformat_write_header(ofmt_ctx, NULL);
+      err = avformat_write_header(ofmt_ctx, &muxer_opts);
       assert(err >= 0);
+      av_dict_free(&muxer_opts);
     } else {
       // input timestamps are in microseconds
       AVRational in_timebase = {1, 1000000};
@@ -103,10 +164,18 @@ VideoWriter::~VideoWriter() {
     err = avio_closep(&this->ofmt_ctx->pb);
     if (err != 0) LOGE("avio_closep failed %d", err);
     avformat_free_context(this->ofmt_ctx);
+    av_dict_free(&this->muxer_opts);
   } else {
-    util::safe_fflush(this->of);
-    fclose(this->of);
-    this->of = nullptr;
+    if (!pending_header.empty()) {
+      writeRaw(NULL, 0);
+    }
+    if (this->preallocated > 0) {
+      if (ftruncate(this->fd, this->written_bytes) != 0) {
+        LOGE("failed to release preallocated space of %s errno=%d", this->vid_path.c_str(), errno);
+      }
+    }
+    close(this->fd);
+    this->fd = -1;
   }
   unlink(this->lock_path.c_str());
 }
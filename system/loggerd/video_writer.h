@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -11,15 +12,24 @@ extern "C" {
 
 class VideoWriter {
 public:
-  VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec);
+  // fragmented writes HEVC and H.264 to a fragmented mp4 instead, named with a .mp4 extension. It has a
+  // fragment per GOP, so it can be played and seeked while it's still being written.
+  VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec,
+              size_t preallocate = 0, bool fragmented = false);
   void write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe);
+  inline size_t bytesWritten() const { return written_bytes; }
   ~VideoWriter();
 private:
+  void writeRaw(uint8_t *data, int len);
+
   std::string vid_path, lock_path;
-  FILE *of = nullptr;
+  int fd = -1;
+  size_t preallocated = 0, written_bytes = 0;
+  std::vector<uint8_t> pending_header;  // written together with the first frame
 
   AVCodecContext *codec_ctx;
   AVFormatContext *ofmt_ctx;
   AVStream *out_stream;
-  bool remuxing;
+  AVDictionary *muxer_opts = NULL;
+  bool remuxing, fragmented;
 };
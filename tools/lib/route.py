@@ -11,11 +11,11 @@ from openpilot.tools.lib.api import CommaApi
 from openpilot.tools.lib.helpers import RE
 
 QLOG_FILENAMES = ['qlog', 'qlog.bz2']
-QCAMERA_FILENAMES = ['qcamera.ts']
+QCAMERA_FILENAMES = ['qcamera.ts', 'qcamera.mp4']
 LOG_FILENAMES = ['rlog', 'rlog.bz2', 'raw_log.bz2']
-CAMERA_FILENAMES = ['fcamera.hevc', 'video.hevc']
-DCAMERA_FILENAMES = ['dcamera.hevc']
-ECAMERA_FILENAMES = ['ecamera.hevc']
+CAMERA_FILENAMES = ['fcamera.hevc', 'video.hevc', 'fcamera.mp4']
+DCAMERA_FILENAMES = ['dcamera.hevc', 'dcamera.mp4']
+ECAMERA_FILENAMES = ['ecamera.hevc', 'ecamera.mp4']
 
 
 class Route:
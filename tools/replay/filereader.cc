@@ -1,6 +1,8 @@
 #include "tools/replay/filereader.h"
 
+#include <cstdio>
 #include <fstream>
+#include <vector>
 
 #include "common/util.h"
 #include "system/hardware/hw.h"
@@ -44,3 +46,53 @@ std::string FileReader::download(const std::string &url, std::atomic<bool> *abor
   }
   return {};
 }
+
+bool FileReader::read(const std::string &file, const DataCallback &callback, std::atomic<bool> *abort) {
+  const bool is_remote = file.find("https://") == 0;
+  const std::string local_file = is_remote ? cacheFilePath(file) : file;
+
+  if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
+    std::ifstream fs(local_file, std::ios::binary | std::ios::in);
+    std::vector<char> buf(1024 * 1024);
+    while (fs && !(abort && *abort)) {
+      fs.read(buf.data(), buf.size());
+      if (fs.gcount() > 0 && !callback(buf.data(), fs.gcount())) return false;
+    }
+    return fs.eof() && !(abort && *abort);
+  } else if (is_remote) {
+    if (!cache_to_local_) return download(file, callback, abort);
+
+    // downloaded to a temporary file, so an interrupted download doesn't leave a partial file in the cache
+    const std::string tmp_file = local_file + "." + util::random_string(8) + ".tmp";
+    std::ofstream fs(tmp_file, std::ios::binary | std::ios::out);
+    bool success = download(file, [&](const char *data, size_t size) {
+      fs.write(data, size);
+      return callback(data, size);
+    }, abort);
+    fs.close();
+    if (!success || !fs || std::rename(tmp_file.c_str(), local_file.c_str()) != 0) {
+      std::remove(tmp_file.c_str());
+    }
+    return success;
+  }
+  return false;
+}
+
+bool FileReader::download(const std::string &url, const DataCallback &callback, std::atomic<bool> *abort) {
+  size_t offset = 0;
+  bool stopped = false;
+  auto receive = [&](const char *data, size_t size) {
+    stopped = !callback(data, size);
+    offset += stopped ? 0 : size;
+    return !stopped;
+  };
+  for (int i = 0; i <= max_retries_ && !stopped && !(abort && *abort); ++i) {
+    if (i > 0) rWarning("download failed, retrying %d", i);
+
+    // a retry continues where the last attempt stopped, the callback already has the data before that
+    if (httpStream(url, offset, receive, abort)) {
+      return true;
+    }
+  }
+  return false;
+}
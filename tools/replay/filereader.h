@@ -3,15 +3,20 @@
 #include <atomic>
 #include <string>
 
+#include "tools/replay/util.h"
+
 class FileReader {
 public:
   FileReader(bool cache_to_local, size_t chunk_size = 0, int retries = 3)
       : cache_to_local_(cache_to_local), chunk_size_(chunk_size), max_retries_(retries) {}
   virtual ~FileReader() {}
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
+  // Passes the file to the callback in pieces as it's read or downloaded, without holding all of it.
+  bool read(const std::string &file, const DataCallback &callback, std::atomic<bool> *abort = nullptr);
 
 private:
   std::string download(const std::string &url, std::atomic<bool> *abort);
+  bool download(const std::string &url, const DataCallback &callback, std::atomic<bool> *abort);
   size_t chunk_size_;
   int max_retries_;
   bool cache_to_local_;
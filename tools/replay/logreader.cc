@@ -1,97 +1,178 @@
 #include "tools/replay/logreader.h"
 
 #include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "tools/replay/filereader.h"
 #include "tools/replay/util.h"
 
-Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
-  words = kj::ArrayPtr<const capnp::word>(amsg.begin(), reader.getEnd());
-  event = reader.getRoot<cereal::Event>();
-  which = event.which();
-  mono_time = event.getLogMonoTime();
-
-  // 1) Send video data at t=timestampEof/timestampSof
-  // 2) Send encodeIndex packet at t=logMonoTime
-  if (frame) {
-    auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
-    // C2 only has eof set, and some older routes have neither
-    uint64_t sof = idx.getTimestampSof();
-    uint64_t eof = idx.getTimestampEof();
-    if (sof > 0) {
-      mono_time = sof;
-    } else if (eof > 0) {
-      mono_time = eof;
-    }
-  }
-}
-
 // class LogReader
 
-LogReader::LogReader(size_t memory_pool_block_size) {
-#ifdef HAS_MEMORY_RESOURCE
-  const size_t buf_size = sizeof(Event) * memory_pool_block_size;
-  mbr_ = std::make_unique<std::pmr::monotonic_buffer_resource>(buf_size);
-#endif
-  events.reserve(memory_pool_block_size);
+LogReader::LogReader(size_t reserve_size) {
+  event_array_.reserve(reserve_size);
 }
 
 LogReader::~LogReader() {
-  for (Event *e : events) {
-    delete e;
+  if (mapped_) {
+    munmap(mapped_, mapped_size_);
   }
 }
 
 bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
-  raw_ = FileReader(local_cache, chunk_size, retries).read(url, abort);
-  if (raw_.empty()) return false;
+  auto decompressor = Decompressor::create(url);
+  if (!decompressor && url.find("://") == std::string::npos && map(url)) {
+    return parse(mapped_, mapped_size_, abort);
+  }
 
-  if (url.find(".bz2") != std::string::npos) {
-    raw_ = decompressBZ2(raw_, abort);
-    if (raw_.empty()) return false;
+  // the log is decompressed and parsed as it's read or downloaded, only the decompressed log is kept
+  auto add = [&](const char *data, size_t size) { return append(data, size) && !(abort && *abort); };
+  bool success = FileReader(local_cache, chunk_size, retries).read(url, [&](const char *data, size_t size) {
+    return decompressor ? decompressor->decompress(data, size, add) : add(data, size);
+  }, abort);
+  if (!success && !corrupt_) return false;
+
+  if (decompressor && !decompressor->finished() && !corrupt_) {
+    rWarning("log is truncated : %s", url.c_str());
   }
-  return parse(abort);
+  return finish(blocks_.empty() ? 0 : block_size_ - block_parsed_ * sizeof(capnp::word), abort);
 }
 
 bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
   raw_.assign((const char *)data, size);
-  return parse(abort);
+  return parse(raw_.data(), raw_.size(), abort);
+}
+
+bool LogReader::map(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr != MAP_FAILED) {
+      mapped_ = (char *)addr;
+      mapped_size_ = st.st_size;
+    }
+  }
+  close(fd);
+  return mapped_ != nullptr;
+}
+
+bool LogReader::parse(const char *data, size_t size, std::atomic<bool> *abort) {
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)data, size / sizeof(capnp::word));
+  size_t parsed = parseMessages(words, abort);
+  return finish(size - parsed * sizeof(capnp::word), abort);
+}
+
+bool LogReader::append(const char *data, size_t size) {
+  while (size > 0 && !corrupt_) {
+    if (blocks_.empty() || block_size_ == blocks_.back().size() * sizeof(capnp::word)) {
+      nextBlock();
+      if (corrupt_) break;
+    }
+    auto &block = blocks_.back();
+    size_t n = std::min(size, block.size() * sizeof(capnp::word) - block_size_);
+    memcpy((char *)block.begin() + block_size_, data, n);
+    block_size_ += n;
+    data += n;
+    size -= n;
+    block_parsed_ += parseMessages(block.slice(block_parsed_, block_size_ / sizeof(capnp::word)));
+  }
+  return !corrupt_;
+}
+
+void LogReader::nextBlock() {
+  const size_t BLOCK_WORDS = 4 * 1024 * 1024;      // 32MB
+  const size_t MAX_MESSAGE_WORDS = 8 * 1024 * 1024;  // capnp's default traversal limit
+  size_t words = BLOCK_WORDS, tail_size = 0;
+  if (!blocks_.empty()) {
+    auto tail = blocks_.back().slice(block_parsed_, blocks_.back().size());
+    size_t msg_words = capnp::expectedSizeInWordsFromPrefix(tail);
+    if (msg_words > MAX_MESSAGE_WORDS) {
+      rWarning("failed to parse log : message of %zu words", msg_words);
+      corrupt_ = true;
+      return;
+    }
+    tail_size = block_size_ - block_parsed_ * sizeof(capnp::word);
+    words = std::max({words, msg_words, tail_size / sizeof(capnp::word) + 1});
+  }
+
+  auto block = kj::heapArray<capnp::word>(words);
+  if (tail_size > 0) {
+    memcpy((char *)block.begin(), (const char *)(blocks_.back().begin() + block_parsed_), tail_size);
+  }
+  if (!blocks_.empty() && block_parsed_ == 0) {
+    blocks_.back() = std::move(block);  // no event is in the last block, it only held the moved message
+  } else {
+    blocks_.push_back(std::move(block));
+  }
+  block_size_ = tail_size;
+  block_parsed_ = 0;
 }
 
-bool LogReader::parse(std::atomic<bool> *abort) {
+size_t LogReader::parseMessages(kj::ArrayPtr<const capnp::word> words, std::atomic<bool> *abort) {
+  const capnp::word *begin = words.begin();
   try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
     while (words.size() > 0 && !(abort && *abort)) {
-#ifdef HAS_MEMORY_RESOURCE
-      Event *evt = new (mbr_.get()) Event(words);
-#else
-      Event *evt = new Event(words);
-#endif
-      // Add encodeIdx packet again as a frame packet for the video stream
-      if (evt->which == cereal::Event::ROAD_ENCODE_IDX ||
-          evt->which == cereal::Event::DRIVER_ENCODE_IDX ||
-          evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+      size_t msg_words = capnp::expectedSizeInWordsFromPrefix(words);
+      if (msg_words > words.size()) break;  // incomplete, the rest of it isn't read yet
 
-#ifdef HAS_MEMORY_RESOURCE
-        Event *frame_evt = new (mbr_.get()) Event(words, true);
-#else
-        Event *frame_evt = new Event(words, true);
-#endif
+      // only the index fields are read, the message is parsed again when it's used
+      auto msg = words.slice(0, msg_words);
+      capnp::FlatArrayMessageReader reader(msg);
+      auto event = reader.getRoot<cereal::Event>();
+      cereal::Event::Which which = event.which();
+      uint64_t mono_time = event.getLogMonoTime();
+      event_array_.emplace_back(which, mono_time, msg);
 
-        events.push_back(frame_evt);
+      // Add encodeIdx packet again as a frame packet for the video stream
+      if (which == cereal::Event::ROAD_ENCODE_IDX ||
+          which == cereal::Event::DRIVER_ENCODE_IDX ||
+          which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
+        // 1) Send video data at t=timestampEof/timestampSof
+        // 2) Send encodeIndex packet at t=logMonoTime
+        auto idx = capnp::AnyStruct::Reader(event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+        // C2 only has eof set, and some older routes have neither
+        uint64_t frame_time = mono_time;
+        if (uint64_t sof = idx.getTimestampSof(); sof > 0) {
+          frame_time = sof;
+        } else if (uint64_t eof = idx.getTimestampEof(); eof > 0) {
+          frame_time = eof;
+        }
+        event_array_.emplace_back(which, frame_time, msg, true);
       }
 
-      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-      events.push_back(evt);
+      words = words.slice(msg_words, words.size());
     }
   } catch (const kj::Exception &e) {
     rWarning("failed to parse log : %s", e.getDescription().cStr());
-    if (!events.empty()) {
-      rWarning("read %zu events from corrupt log", events.size());
-    }
+    corrupt_ = true;
+  }
+  return words.begin() - begin;
+}
+
+bool LogReader::finish(size_t unparsed_size, std::atomic<bool> *abort) {
+  if (unparsed_size > 0 && !corrupt_) {
+    rWarning("failed to parse log : %zu bytes at the end are incomplete", unparsed_size);
+    corrupt_ = true;
+  }
+  if (corrupt_ && !event_array_.empty()) {
+    rWarning("read %zu events from corrupt log", event_array_.size());
   }
 
-  if (!events.empty() && !(abort && *abort)) {
-    std::sort(events.begin(), events.end(), Event::lessThan());
+  if (!event_array_.empty() && !(abort && *abort)) {
+    // sorted in place, so searching and merging the pointers walks the events in memory order
+    std::sort(event_array_.begin(), event_array_.end(), Event::lessThan());
+    event_array_.shrink_to_fit();
+    events.reserve(event_array_.size());
+    for (Event &e : event_array_) {
+      events.push_back(&e);
+    }
     return true;
   }
   return false;
@@ -1,67 +1,77 @@
 #pragma once
 
-#if __has_include(<memory_resource>)
-#define HAS_MEMORY_RESOURCE 1
-#include <memory_resource>
-#endif
-
 #include <memory>
 #include <string>
 #include <vector>
 
+#include <capnp/serialize.h>
+
 #include "cereal/gen/cpp/log.capnp.h"
 #include "system/camerad/cameras/camera_common.h"
 
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
 const int MAX_CAMERAS = std::size(ALL_CAMERAS);
-const int DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE = 65000;
+const int DEFAULT_EVENT_RESERVE_SIZE = 65000;
 
+// An event of the log, with what's needed to sort and filter it, and where its message is.
+// The message is only parsed when it's read, with capnp::FlatArrayMessageReader(e->words()).
 class Event {
 public:
-  Event(cereal::Event::Which which, uint64_t mono_time) : reader(kj::ArrayPtr<capnp::word>{}) {
-    // construct a dummy Event for binary search, e.g std::upper_bound
-    this->which = which;
-    this->mono_time = mono_time;
-  }
-  Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame = false);
-  inline kj::ArrayPtr<const capnp::byte> bytes() const { return words.asBytes(); }
+  Event(cereal::Event::Which which, uint64_t mono_time, const kj::ArrayPtr<const capnp::word> &data = {}, bool frame = false)
+      : mono_time(mono_time), data_(data.begin()), size_(data.size()), which(which), frame(frame) {}
+  inline kj::ArrayPtr<const capnp::word> words() const { return kj::arrayPtr(data_, size_); }
+  inline kj::ArrayPtr<const capnp::byte> bytes() const { return words().asBytes(); }
 
   struct lessThan {
-    inline bool operator()(const Event *l, const Event *r) {
-      return l->mono_time < r->mono_time || (l->mono_time == r->mono_time && l->which < r->which);
+    inline bool operator()(const Event &l, const Event &r) {
+      return l.mono_time < r.mono_time || (l.mono_time == r.mono_time && l.which < r.which);
     }
+    inline bool operator()(const Event *l, const Event *r) { return (*this)(*l, *r); }
   };
 
-#if HAS_MEMORY_RESOURCE
-  void *operator new(size_t size, std::pmr::monotonic_buffer_resource *mbr) {
-    return mbr->allocate(size);
-  }
-  void operator delete(void *ptr) {
-    // No-op. memory used by EventMemoryPool increases monotonically until the logReader is destroyed.
-  }
-#endif
-
   uint64_t mono_time;
+
+private:
+  const capnp::word *data_;
+  uint32_t size_;
+
+public:
   cereal::Event::Which which;
-  cereal::Event::Reader event;
-  capnp::FlatArrayMessageReader reader;
-  kj::ArrayPtr<const capnp::word> words;
   bool frame;
 };
 
+static_assert(sizeof(Event) == 24, "Event should stay small, there are millions of them");
+
 class LogReader {
 public:
-  LogReader(size_t memory_pool_block_size = DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE);
+  LogReader(size_t reserve_size = DEFAULT_EVENT_RESERVE_SIZE);
   ~LogReader();
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr,
             bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
+  // sorted by time, they point into the array of events
   std::vector<Event*> events;
 
 private:
-  bool parse(std::atomic<bool> *abort);
+  bool map(const std::string &path);
+  bool parse(const char *data, size_t size, std::atomic<bool> *abort);
+  // adds data of a log that's being read and parses the messages it completes
+  bool append(const char *data, size_t size);
+  void nextBlock();
+  // parses the complete messages at the start of words, returns the number of words used
+  size_t parseMessages(kj::ArrayPtr<const capnp::word> words, std::atomic<bool> *abort = nullptr);
+  bool finish(size_t unparsed_size, std::atomic<bool> *abort);
+
   std::string raw_;
-#ifdef HAS_MEMORY_RESOURCE
-  std::unique_ptr<std::pmr::monotonic_buffer_resource> mbr_;
-#endif
+  // Logs that are downloaded or decompressed are parsed while they're read, into blocks that
+  // each hold whole messages. A message that doesn't fit in the last block moves to a new one.
+  std::vector<kj::Array<capnp::word>> blocks_;
+  size_t block_size_ = 0;    // bytes in the last block
+  size_t block_parsed_ = 0;  // words of the last block that are parsed
+  bool corrupt_ = false;
+  // uncompressed local logs are mapped instead of read into raw_
+  char *mapped_ = nullptr;
+  size_t mapped_size_ = 0;
+  // the events in one array, sorted by time when the log is parsed
+  std::vector<Event> event_array_;
 };
@@ -33,8 +33,6 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
     pm = std::make_unique<PubMaster>(s);
   }
   route_ = std::make_unique<Route>(route, data_dir);
-  events_ = std::make_unique<std::vector<Event *>>();
-  new_events_ = std::make_unique<std::vector<Event *>>();
 }
 
 Replay::~Replay() {
@@ -54,6 +52,8 @@ void Replay::stop() {
   }
   camera_server_.reset(nullptr);
   timeline_future.waitForFinished();
+  events_.clear();
+  segments_merged_.clear();
   segments_.clear();
   rInfo("shutdown: done");
 }
@@ -142,7 +142,8 @@ void Replay::buildTimeline() {
 
     for (const Event *e : log->events) {
       if (e->which == cereal::Event::Which::CONTROLS_STATE) {
-        auto cs = e->event.getControlsState();
+        capnp::FlatArrayMessageReader reader(e->words());
+        auto cs = reader.getRoot<cereal::Event>().getControlsState();
 
         if (engaged != cs.getEnabled()) {
           if (engaged) {
@@ -226,9 +227,26 @@ void Replay::queueSegment() {
 
   auto begin = std::prev(cur, std::min<int>(segment_cache_limit / 2, std::distance(segments_.begin(), cur)));
   auto end = std::next(begin, std::min<int>(segment_cache_limit, std::distance(begin, segments_.end())));
-  // load one segment at a time
-  auto it = std::find_if(cur, end, [](auto &it) { return !it.second || !it.second->isLoaded(); });
-  if (it != end && !it->second) {
+  // load up to segment_load_limit segments at a time, the ones closest to the current segment first.
+  // segments ahead of the current one go before the ones behind it at the same distance.
+  std::vector<SegmentMap::iterator> to_load;
+  int loading = 0;
+  for (auto it = begin; it != end; ++it) {
+    if (!it->second) {
+      to_load.push_back(it);
+    } else if (!it->second->isLoaded()) {
+      ++loading;
+    }
+  }
+  const int cur_n = cur->first;
+  std::stable_sort(to_load.begin(), to_load.end(), [cur_n](auto &l, auto &r) {
+    int dl = l->first - cur_n, dr = r->first - cur_n;
+    return std::abs(dl) != std::abs(dr) ? std::abs(dl) < std::abs(dr) : dl > dr;
+  });
+  for (auto it : to_load) {
+    // the current segment is needed to stream, it doesn't wait for a free slot
+    if (loading++ >= segment_load_limit && it != cur) break;
+
     rDebug("loading segment %d...", it->first);
     it->second = std::make_unique<Segment>(it->first, route_->at(it->first), flags_);
     QObject::connect(it->second.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
@@ -236,7 +254,7 @@ void Replay::queueSegment() {
 
   mergeSegments(begin, end);
 
-  // free segments out of current semgnt window.
+  // free segments out of current semgnt window. this also cancels the ones still loading, after a seek.
   std::for_each(segments_.begin(), begin, [](auto &e) { e.second.reset(nullptr); });
   std::for_each(end, segments_.end(), [](auto &e) { e.second.reset(nullptr); });
 
@@ -250,36 +268,43 @@ void Replay::queueSegment() {
 
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
   std::vector<int> segments_need_merge;
-  size_t new_events_size = 0;
   for (auto it = begin; it != end; ++it) {
     if (it->second && it->second->isLoaded()) {
       segments_need_merge.push_back(it->first);
-      new_events_size += it->second->log->events.size();
     }
   }
 
   if (segments_need_merge != segments_merged_) {
+    // only the segments that entered or left the window are merged or removed
+    std::vector<int> segments_add, segments_remove;
+    std::set_difference(segments_need_merge.begin(), segments_need_merge.end(), segments_merged_.begin(), segments_merged_.end(),
+                        std::back_inserter(segments_add));
+    std::set_difference(segments_merged_.begin(), segments_merged_.end(), segments_need_merge.begin(), segments_need_merge.end(),
+                        std::back_inserter(segments_remove));
     std::string s;
     for (int i = 0; i < segments_need_merge.size(); ++i) {
       s += std::to_string(segments_need_merge[i]);
       if (i != segments_need_merge.size() - 1) s += ", ";
     }
     rDebug("merge segments %s", s.c_str());
-    new_events_->clear();
-    new_events_->reserve(new_events_size);
-    for (int n : segments_need_merge) {
-      size_t size = new_events_->size();
-      const auto &events = segments_[n]->log->events;
-      std::copy_if(events.begin(), events.end(), std::back_inserter(*new_events_),
+
+    std::vector<std::vector<Event *>> runs(segments_add.size());
+    for (int i = 0; i < segments_add.size(); ++i) {
+      const auto &events = segments_[segments_add[i]]->log->events;
+      std::copy_if(events.begin(), events.end(), std::back_inserter(runs[i]),
                    [this](auto e) { return e->which < sockets_.size() && sockets_[e->which] != nullptr; });
-      std::inplace_merge(new_events_->begin(), new_events_->begin() + size, new_events_->end(), Event::lessThan());
     }
 
     if (stream_thread_) {
       emit segmentsMerged();
     }
     updateEvents([&]() {
-      events_.swap(new_events_);
+      for (int n : segments_remove) {
+        removeEvents(segments_[n]->log->events);
+      }
+      for (const auto &run : runs) {
+        insertEvents(run);
+      }
       segments_merged_ = segments_need_merge;
       // Do not wake up the stream thread if the current segment has not been merged.
       return isSegmentMerged(current_segment_) || (segments_.count(current_segment_) == 0);
@@ -287,6 +312,37 @@ void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::
   }
 }
 
+void Replay::insertEvents(const std::vector<Event *> &run) {
+  if (run.empty()) return;
+
+  // segments barely overlap, only the events in the time range of the run are merged with it.
+  // a segment at either end of the window goes to the end of the deque without moving the others.
+  auto lo = std::upper_bound(events_.begin(), events_.end(), run.front(), Event::lessThan());
+  auto hi = std::upper_bound(lo, events_.end(), run.back(), Event::lessThan());
+  if (lo == hi) {
+    events_.insert(lo, run.begin(), run.end());
+    return;
+  }
+
+  std::vector<Event *> merged;
+  merged.reserve((hi - lo) + run.size());
+  std::merge(lo, hi, run.begin(), run.end(), std::back_inserter(merged), Event::lessThan());
+  const size_t pos = lo - events_.begin();
+  events_.insert(hi, run.size(), nullptr);
+  std::copy(merged.begin(), merged.end(), events_.begin() + pos);
+}
+
+void Replay::removeEvents(const std::vector<Event *> &segment_events) {
+  if (segment_events.empty()) return;
+
+  // the log keeps its events in one array sorted by time, so its first and last events bound them in memory
+  const Event *first = segment_events.front(), *last = segment_events.back();
+  auto in_segment = [first, last](const Event *e) { return !std::less<const Event *>()(e, first) && !std::less<const Event *>()(last, e); };
+  auto lo = std::lower_bound(events_.begin(), events_.end(), first, Event::lessThan());
+  auto hi = std::upper_bound(lo, events_.end(), last, Event::lessThan());
+  events_.erase(std::remove_if(lo, hi, in_segment), hi);
+}
+
 void Replay::startStream(const Segment *cur_segment) {
   const auto &events = cur_segment->log->events;
 
@@ -297,9 +353,11 @@ void Replay::startStream(const Segment *cur_segment) {
   // write CarParams
   auto it = std::find_if(events.begin(), events.end(), [](auto e) { return e->which == cereal::Event::Which::CAR_PARAMS; });
   if (it != events.end()) {
-    car_fingerprint_ = (*it)->event.getCarParams().getCarFingerprint();
+    capnp::FlatArrayMessageReader reader((*it)->words());
+    auto car_params = reader.getRoot<cereal::Event>().getCarParams();
+    car_fingerprint_ = car_params.getCarFingerprint();
     capnp::MallocMessageBuilder builder;
-    builder.setRoot((*it)->event.getCarParams());
+    builder.setRoot(car_params);
     auto words = capnp::messageToFlatArray(builder);
     auto bytes = words.asBytes();
     Params().put("CarParams", (const char *)bytes.begin(), bytes.size());
@@ -340,7 +398,8 @@ void Replay::publishMessage(const Event *e) {
       sockets_[e->which] = nullptr;
     }
   } else {
-    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], e->event}});
+    capnp::FlatArrayMessageReader reader(e->words());
+    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], reader.getRoot<cereal::Event>()}});
   }
 }
 
@@ -354,7 +413,8 @@ void Replay::publishFrame(const Event *e) {
       (e->which == cereal::Event::WIDE_ROAD_ENCODE_IDX && !hasFlag(REPLAY_FLAG_ECAM))) {
     return;
   }
-  auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
+  capnp::FlatArrayMessageReader reader(e->words());
+  auto eidx = capnp::AnyStruct::Reader(reader.getRoot<cereal::Event>()).getPointerSection()[0].getAs<cereal::EncodeIndex>();
   if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && isSegmentMerged(eidx.getSegmentNum())) {
     CameraType cam = cam_types.at(e->which);
     camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam].get(), eidx);
@@ -372,8 +432,8 @@ void Replay::stream() {
     if (exit_) break;
 
     Event cur_event(cur_which, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    auto eit = std::upper_bound(events_.begin(), events_.end(), &cur_event, Event::lessThan());
+    if (eit == events_.end()) {
       rInfo("waiting for events...");
       continue;
     }
@@ -381,7 +441,7 @@ void Replay::stream() {
     uint64_t evt_start_ts = cur_mono_time_;
     uint64_t loop_start_ts = nanos_since_boot();
 
-    for (auto end = events_->end(); !updating_events_ && eit != end; ++eit) {
+    for (auto end = events_.end(); !updating_events_ && eit != end; ++eit) {
       const Event *evt = (*eit);
       cur_which = evt->which;
       cur_mono_time_ = evt->mono_time;
@@ -417,7 +477,7 @@ void Replay::stream() {
       camera_server_->waitForSent();
     }
 
-    if (eit == events_->end() && !hasFlag(REPLAY_FLAG_NO_LOOP)) {
+    if (eit == events_.end() && !hasFlag(REPLAY_FLAG_NO_LOOP)) {
       int last_segment = segments_.empty() ? 0 : segments_.rbegin()->first;
       if (current_segment_ >= last_segment && isSegmentMerged(last_segment)) {
         rInfo("reaches the end of route, restart from beginning");
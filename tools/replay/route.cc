@@ -86,13 +86,13 @@ void Route::addFileToSegment(int n, const QString &file) {
     segments_[n].rlog = file;
   } else if (name == "qlog.bz2" || name == "qlog") {
     segments_[n].qlog = file;
-  } else if (name == "fcamera.hevc") {
+  } else if (name == "fcamera.hevc" || name == "fcamera.mp4") {
     segments_[n].road_cam = file;
-  } else if (name == "dcamera.hevc") {
+  } else if (name == "dcamera.hevc" || name == "dcamera.mp4") {
     segments_[n].driver_cam = file;
-  } else if (name == "ecamera.hevc") {
+  } else if (name == "ecamera.hevc" || name == "ecamera.mp4") {
     segments_[n].wide_road_cam = file;
-  } else if (name == "qcamera.ts") {
+  } else if (name == "qcamera.ts" || name == "qcamera.mp4") {
     segments_[n].qcamera = file;
   }
 }
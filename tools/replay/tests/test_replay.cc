@@ -1,4 +1,8 @@
+#include <bzlib.h>
+
+#include <algorithm>
 #include <chrono>
+#include <random>
 #include <thread>
 
 #include <QDebug>
@@ -60,6 +64,57 @@ TEST_CASE("FileReader") {
   }
 }
 
+std::string compressBZ2(const std::string &in) {
+  unsigned int size = in.size() + in.size() / 100 + 600;
+  std::string out(size, '\0');
+  REQUIRE(BZ2_bzBuffToBuffCompress(out.data(), &size, (char *)in.data(), in.size(), 9, 0, 0) == BZ_OK);
+  out.resize(size);
+  return out;
+}
+
+TEST_CASE("Decompressor") {
+  // larger than the output buffer of the decompressor, and only slightly compressible
+  std::mt19937 rng(42);
+  std::string content(2 * 1024 * 1024, '\0');
+  std::generate(content.begin(), content.end(), [&]() { return 'a' + rng() % 16; });
+  const std::string compressed = compressBZ2(content.substr(0, content.size() / 3)) + compressBZ2(content.substr(content.size() / 3));
+
+  REQUIRE(Decompressor::create("rlog") == nullptr);
+  auto bz2 = Decompressor::create("https://example.com/rlog.bz2?sig=abc");
+  REQUIRE(bz2 != nullptr);
+  std::string out;
+  auto append = [&](const char *data, size_t size) { out.append(data, size); return true; };
+
+  SECTION("whole input in chunks") {
+    const size_t chunk_size = GENERATE(1000, 1024 * 1024, 64 * 1024 * 1024);
+    for (size_t pos = 0; pos < compressed.size(); pos += chunk_size) {
+      REQUIRE(bz2->decompress(compressed.data() + pos, std::min(chunk_size, compressed.size() - pos), append));
+    }
+    REQUIRE(bz2->finished());
+    REQUIRE(out == content);
+  }
+  SECTION("truncated input") {
+    const size_t size = GENERATE(100, 1024 * 1024);
+    REQUIRE(bz2->decompress(compressed.data(), size, append));
+    REQUIRE_FALSE(bz2->finished());
+    REQUIRE(out.size() < content.size());
+    REQUIRE(content.compare(0, out.size(), out) == 0);
+  }
+  SECTION("corrupt input") {
+    std::string corrupt = compressed;
+    std::fill(corrupt.begin() + corrupt.size() / 2, corrupt.begin() + corrupt.size() / 2 + 1024, 0);
+    REQUIRE_FALSE(bz2->decompress(corrupt.data(), corrupt.size(), append));
+    REQUIRE_FALSE(bz2->finished());
+  }
+  SECTION("not bz2") {
+    REQUIRE_FALSE(bz2->decompress(content.data(), content.size(), append));
+    REQUIRE(out.empty());
+  }
+  SECTION("output aborted") {
+    REQUIRE_FALSE(bz2->decompress(compressed.data(), compressed.size(), [](const char *, size_t) { return false; }));
+  }
+}
+
 TEST_CASE("LogReader") {
   SECTION("corrupt log") {
     FileReader reader(true);
@@ -70,6 +125,34 @@ TEST_CASE("LogReader") {
     REQUIRE(log.load((std::byte *)corrupt_content.data(), corrupt_content.size()));
     REQUIRE(log.events.size() > 0);
   }
+  SECTION("mapped local log") {
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    const std::string path = "/tmp/test_logreader_rlog";
+    REQUIRE(util::write_file(path.c_str(), content.data(), content.size(), O_WRONLY | O_CREAT | O_TRUNC) == 0);
+
+    LogReader mapped, loaded;
+    REQUIRE(mapped.load(path));
+    REQUIRE(loaded.load((std::byte *)content.data(), content.size()));
+    REQUIRE(mapped.events.size() == loaded.events.size());
+    for (size_t i = 0; i < mapped.events.size(); ++i) {
+      REQUIRE(mapped.events[i]->which == loaded.events[i]->which);
+      REQUIRE(mapped.events[i]->mono_time == loaded.events[i]->mono_time);
+      auto a = mapped.events[i]->bytes(), b = loaded.events[i]->bytes();
+      REQUIRE(std::equal(a.begin(), a.end(), b.begin(), b.end()));
+    }
+    std::remove(path.c_str());
+  }
+  SECTION("streamed log") {
+    LogReader streamed, loaded;
+    REQUIRE(streamed.load(TEST_RLOG_URL, nullptr, true));
+    std::string content = decompressBZ2(FileReader(true).read(TEST_RLOG_URL));
+    REQUIRE(loaded.load((std::byte *)content.data(), content.size()));
+    REQUIRE(streamed.events.size() == loaded.events.size());
+    for (size_t i = 0; i < streamed.events.size(); ++i) {
+      auto a = streamed.events[i]->bytes(), b = loaded.events[i]->bytes();
+      REQUIRE(std::equal(a.begin(), a.end(), b.begin(), b.end()));
+    }
+  }
 }
 
 void read_segment(int n, const SegmentFile &segment_file, uint32_t flags) {
@@ -179,13 +262,13 @@ void TestReplay::testSeekTo(int seek_to) {
     }
 
     Event cur_event(cereal::Event::Which::INIT_DATA, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    auto eit = std::upper_bound(events_.begin(), events_.end(), &cur_event, Event::lessThan());
+    if (eit == events_.end()) {
       qDebug() << "waiting for events...";
       continue;
     }
 
-    REQUIRE(std::is_sorted(events_->begin(), events_->end(), Event::lessThan()));
+    REQUIRE(std::is_sorted(events_.begin(), events_.end(), Event::lessThan()));
     const int seek_to_segment = seek_to / 60;
     const int event_seconds = ((*eit)->mono_time - route_start_ts_) / 1e9;
     current_segment_ = event_seconds / 60;
@@ -4,9 +4,11 @@
 #include <curl/curl.h>
 #include <openssl/sha.h>
 
+#include <algorithm>
 #include <cstdarg>
 #include <cstring>
 #include <cassert>
+#include <climits>
 #include <cmath>
 #include <fstream>
 #include <iostream>
@@ -14,6 +16,7 @@
 #include <mutex>
 #include <numeric>
 #include <utility>
+#include <vector>
 
 #include "common/timing.h"
 #include "common/util.h"
@@ -90,6 +93,78 @@ size_t write_cb(char *data, size_t size, size_t count, void *userp) {
 
 size_t dumy_write_cb(char *data, size_t size, size_t count, void *userp) { return size * count; }
 
+struct StreamWriter {
+  const DataCallback *callback;
+  size_t written;
+};
+
+size_t stream_write_cb(char *data, size_t size, size_t count, void *userp) {
+  auto w = (StreamWriter *)userp;
+  size_t bytes = size * count;
+  if (!(*w->callback)(data, bytes)) return 0;  // fails the transfer
+
+  w->written += bytes;
+  return bytes;
+}
+
+const size_t DECOMPRESS_OUTPUT_SIZE = 1024 * 1024;
+
+class BZ2Decompressor : public Decompressor {
+public:
+  BZ2Decompressor() : buf(DECOMPRESS_OUTPUT_SIZE) {}
+  ~BZ2Decompressor() {
+    if (in_stream) BZ2_bzDecompressEnd(&strm);
+  }
+
+  bool decompress(const char *data, size_t size, const DataCallback &output) override {
+    bool out_full = false;
+    // continue without input while the output fills the buffer, there may be more of it
+    while (size > 0 || (out_full && in_stream)) {
+      if (!in_stream) {
+        strm = {};
+        int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+        assert(bzerror == BZ_OK);
+        in_stream = true;
+      }
+      const unsigned int in_size = std::min<size_t>(size, UINT_MAX);
+      strm.next_in = (char *)data;
+      strm.avail_in = in_size;
+      strm.next_out = buf.data();
+      strm.avail_out = buf.size();
+      int bzerror = BZ2_bzDecompress(&strm);
+      const size_t consumed = in_size - strm.avail_in;
+      const size_t produced = buf.size() - strm.avail_out;
+      data += consumed;
+      size -= consumed;
+
+      if (bzerror != BZ_OK && bzerror != BZ_STREAM_END) {
+        rWarning("decompressBZ2 error : %d", bzerror);
+        return false;
+      }
+      if (bzerror == BZ_OK && size > 0 && consumed == 0 && produced == 0) {
+        rWarning("decompressBZ2 error : content is corrupt");
+        return false;
+      }
+      if (produced > 0 && !output(buf.data(), produced)) {
+        return false;
+      }
+      if (bzerror == BZ_STREAM_END) {
+        BZ2_bzDecompressEnd(&strm);
+        in_stream = false;
+        streams_ended = true;
+      }
+      out_full = strm.avail_out == 0;
+    }
+    return true;
+  }
+  bool finished() const override { return streams_ended && !in_stream; }
+
+private:
+  bz_stream strm = {};
+  bool in_stream = false, streams_ended = false;
+  std::vector<char> buf;
+};
+
 struct DownloadStats {
   void installDownloadProgressHandler(DownloadProgressHandler handler) {
     std::lock_guard lk(lock);
@@ -254,6 +329,59 @@ std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool>
   return httpDownload(url, result, chunk_size, size, abort) ? result : "";
 }
 
+bool httpStream(const std::string &url, size_t offset, const DataCallback &callback, std::atomic<bool> *abort) {
+  size_t size = getRemoteFileSize(url, abort);
+  if (size == 0 || offset > size) return false;
+  if (offset == size) return true;
+
+  download_stats.add(url, size);
+
+  CURLM *cm = curl_multi_init();
+  CURL *eh = curl_easy_init();
+  StreamWriter writer = {.callback = &callback, .written = offset};
+  curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, stream_write_cb);
+  curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)&writer);
+  curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%zu-%zu", offset, size - 1).c_str());
+  curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
+  curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
+  curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
+  curl_multi_add_handle(cm, eh);
+
+  int still_running = 1;
+  while (still_running > 0 && !(abort && *abort)) {
+    curl_multi_wait(cm, nullptr, 0, 1000, nullptr);
+    curl_multi_perform(cm, &still_running);
+    download_stats.update(url, writer.written);
+  }
+
+  bool success = false;
+  CURLMsg *msg;
+  int msgs_left = -1;
+  while ((msg = curl_multi_info_read(cm, &msgs_left)) && !(abort && *abort)) {
+    if (msg->msg == CURLMSG_DONE) {
+      if (msg->data.result == CURLE_OK) {
+        long res_status = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
+        success = res_status == 206 && writer.written == size;
+        if (res_status != 206) {
+          rWarning("Download failed: http error code: %d", res_status);
+        }
+      } else if (msg->data.result != CURLE_WRITE_ERROR) {
+        rWarning("Download failed: connection failure: %d", msg->data.result);
+      }
+    }
+  }
+
+  download_stats.update(url, writer.written, success);
+  download_stats.remove(url);
+
+  curl_multi_remove_handle(cm, eh);
+  curl_easy_cleanup(eh);
+  curl_multi_cleanup(cm);
+  return success;
+}
+
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
   size_t size = getRemoteFileSize(url, abort);
   if (size == 0) return false;
@@ -270,37 +398,25 @@ std::string decompressBZ2(const std::string &in, std::atomic<bool> *abort) {
 std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool> *abort) {
   if (in_size == 0) return {};
 
-  bz_stream strm = {};
-  int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
-  assert(bzerror == BZ_OK);
-
-  strm.next_in = (char *)in;
-  strm.avail_in = in_size;
-  std::string out(in_size * 5, '\0');
-  do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
-
-    const char *prev_write_pos = strm.next_out;
-    bzerror = BZ2_bzDecompress(&strm);
-    if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
-      // content is corrupt
-      bzerror = BZ_STREAM_END;
-      rWarning("decompressBZ2 error : content is corrupt");
-      break;
-    }
-
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
-      out.resize(out.size() * 2);
-    }
-  } while (bzerror == BZ_OK && !(abort && *abort));
+  std::string out;
+  out.reserve(in_size * 5);
+  BZ2Decompressor bz2;
+  bool success = bz2.decompress((const char *)in, in_size, [&](const char *data, size_t size) {
+    out.append(data, size);
+    return !(abort && *abort);
+  });
+  if (success && !bz2.finished()) {
+    rWarning("decompressBZ2 error : content is truncated");
+  }
+  return success ? out : std::string{};
+}
 
-  BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
-    return out;
+std::unique_ptr<Decompressor> Decompressor::create(const std::string &file) {
+  const std::string path = getUrlWithoutQuery(file);
+  if (util::ends_with(path, ".bz2")) {
+    return std::make_unique<BZ2Decompressor>();
   }
-  return {};
+  return nullptr;
 }
 
 void precise_nano_sleep(long sleep_ns) {
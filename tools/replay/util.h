@@ -2,6 +2,7 @@
 
 #include <atomic>
 #include <functional>
+#include <memory>
 #include <string>
 
 enum class ReplyMsgType {
@@ -28,6 +29,24 @@ std::string getUrlWithoutQuery(const std::string &url);
 size_t getRemoteFileSize(const std::string &url, std::atomic<bool> *abort = nullptr);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
 
+// Receives data in order, in pieces, as it's read. Returns false to stop reading.
+typedef std::function<bool(const char *data, size_t size)> DataCallback;
+// Downloads the file from offset on over one connection, passing the data to the callback as it arrives.
+bool httpStream(const std::string &url, size_t offset, const DataCallback &callback, std::atomic<bool> *abort = nullptr);
+
+// Decompresses the data as it arrives, the output is passed on in pieces. Concatenated streams,
+// as loggerd writes them, are decompressed one after another.
+class Decompressor {
+public:
+  virtual ~Decompressor() {}
+  // returns false if the data is corrupt, or the output callback returned false
+  virtual bool decompress(const char *data, size_t size, const DataCallback &output) = 0;
+  // true if the data so far ends with a complete stream
+  virtual bool finished() const = 0;
+  // a decompressor for .bz2 files, nullptr for files that aren't compressed
+  static std::unique_ptr<Decompressor> create(const std::string &file);
+};
+
 typedef std::function<void(uint64_t cur, uint64_t total, bool success)> DownloadProgressHandler;
 void installDownloadProgressHandler(DownloadProgressHandler);
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);